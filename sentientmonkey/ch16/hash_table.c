@@ -14,11 +14,14 @@ unsigned long hash(char* key) {
     return hash;
 }
 
-entry* entry_new(char* key, void* value) {
+entry* entry_new(char* key, void* value, unsigned long hashed) {
     entry* e = malloc(sizeof(entry));
     e->key = strdup(key);
+    e->hash = hashed;
     e->value = value;
     e->next = NULL;
+    e->newer = NULL;
+    e->older = NULL;
     return e;
 }
 
@@ -39,6 +42,9 @@ hash_table* hash_table_new() {
     h->print_func = NULL;
     h->copy_func = NULL;
     h->delete_func = NULL;
+    h->limit = 0;
+    h->newest = NULL;
+    h->oldest = NULL;
     for(unsigned int i=0; i < size; i++) {
         h->entries[i] = NULL;
     }
@@ -56,11 +62,52 @@ void hash_table_register_delete(hash_table* h, delete_func delete_func) {
     h->delete_func = delete_func;
 }
 
+// keep at most limit entries, dropping the least recently added or got
+// once there are more. only call on an empty table.
+void hash_table_set_limit(hash_table* h, unsigned long limit) {
+    h->limit = limit;
+}
+
+void lru_unlink(hash_table* h, entry* e) {
+    if (e->newer != NULL) {
+        e->newer->older = e->older;
+    } else {
+        h->newest = e->older;
+    }
+    if (e->older != NULL) {
+        e->older->newer = e->newer;
+    } else {
+        h->oldest = e->newer;
+    }
+    e->newer = NULL;
+    e->older = NULL;
+}
+
+void lru_push(hash_table* h, entry* e) {
+    e->older = h->newest;
+    e->newer = NULL;
+    if (h->newest != NULL) {
+        h->newest->newer = e;
+    } else {
+        h->oldest = e;
+    }
+    h->newest = e;
+}
+
 void* hash_table_get(hash_table* h, char* key) {
-    unsigned long bucket = hash(key) % h->size;
+    return hash_table_get_hashed(h, key, hash(key));
+}
+
+// for callers that already know hash(key)
+void* hash_table_get_hashed(hash_table* h, char* key, unsigned long hashed) {
+    unsigned long bucket = hashed % h->size;
     entry* e = h->entries[bucket];
     while (e != NULL) {
-        if (strcmp(key, e->key) == 0) {
+        if (e->hash == hashed && strcmp(key, e->key) == 0) {
+            if (h->limit) {
+                lru_unlink(h, e);
+                lru_push(h, e);
+            }
             return e->value;
         }
         e = e->next;
@@ -69,12 +116,16 @@ void* hash_table_get(hash_table* h, char* key) {
 }
 
 void* hash_table_add(hash_table* h, char* key, void* value) {
-    unsigned long bucket = hash(key) % h->size;
+    return hash_table_add_hashed(h, key, value, hash(key));
+}
+
+void* hash_table_add_hashed(hash_table* h, char* key, void* value, unsigned long hashed) {
+    unsigned long bucket = hashed % h->size;
     void* new_value = value;
     if (h->copy_func != NULL) {
         new_value = h->copy_func(value);
     }
-    entry* e = entry_new(key, new_value);
+    entry* e = entry_new(key, new_value, hashed);
     void* r = NULL;
 
     entry* parent = h->entries[bucket];
@@ -84,8 +135,11 @@ void* hash_table_add(hash_table* h, char* key, void* value) {
         h->capacity += 1;
     }
     while (parent != NULL) {
-        if (strcmp(parent->key, key) == 0) {
+        if (parent->hash == hashed && strcmp(parent->key, key) == 0) {
             e->next = parent->next;
+            if (h->limit) {
+                lru_unlink(h, parent);
+            }
             r = entry_delete(parent);
             if (previous == NULL) {
                 h->entries[bucket] = e;
@@ -104,7 +158,7 @@ void* hash_table_add(hash_table* h, char* key, void* value) {
     }
 
     // if exceeds the load capacity, double in size
-    double load = (h->capacity / h->size);
+    double load = ((double)h->capacity / h->size);
     if (load > DEFAULT_LOAD_FACTOR) {
         hash_table_resize(h, h->size*2);
     }
@@ -112,6 +166,14 @@ void* hash_table_add(hash_table* h, char* key, void* value) {
         h->delete_func(r);
         r = NULL;
     }
+
+    // over the limit, drop whatever was used longest ago
+    if (h->limit) {
+        lru_push(h, e);
+        if (h->capacity > h->limit) {
+            hash_table_remove(h, h->oldest->key);
+        }
+    }
     return r;
 }
 
@@ -126,12 +188,17 @@ void* hash_table_remove(hash_table* h, char* key) {
         if (strcmp(key, e->key) == 0) {
             h->capacity -= 1;
             entry* next = e->next;
+            if (h->limit) {
+                lru_unlink(h, e);
+            }
             r = entry_delete(e);
             if (previous == NULL) {
                 h->entries[bucket] = next;
             } else {
                 previous->next = next;
             }
+            // keys are unique, and key itself may have just been freed
+            break;
         } else {
             previous = e;
             e = e->next;
@@ -202,7 +269,7 @@ void hash_table_resize(hash_table* h, unsigned long size) {
     for (unsigned long i=0; i < h->size; i++) {
         e = h->entries[i];
         while (e != NULL) {
-            bucket = hash(e->key) % size;
+            bucket = e->hash % size;
             p = new_entries[bucket];
             if (p == NULL) {
                 new_entries[bucket] = e;
@@ -14,22 +14,32 @@ struct hash_table {
     print_func print_func;
     copy_func copy_func;
     delete_func delete_func;
+    unsigned long limit;    /* most entries kept, 0 for no limit */
+    entry* newest;          /* with a limit, entries by when they were used */
+    entry* oldest;
 };
 
 struct entry {
     char* key;
+    unsigned long hash;
     void* value;
     entry* next;
+    entry* newer;
+    entry* older;
 };
 
 
+unsigned long hash(char* key);
 hash_table* hash_table_new();
 void hash_table_register_print(hash_table* h, print_func print_func);
 void hash_table_register_copy(hash_table* h, copy_func copy_func);
 void hash_table_register_delete(hash_table* h, delete_func delete_func);
+void hash_table_set_limit(hash_table* h, unsigned long limit);
 void hash_table_delete(hash_table* h);
 void hash_table_print(hash_table* h);
 void* hash_table_add(hash_table* h, char* key, void* value);
 void* hash_table_get(hash_table* h, char* key);
+void* hash_table_add_hashed(hash_table* h, char* key, void* value, unsigned long hashed);
+void* hash_table_get_hashed(hash_table* h, char* key, unsigned long hashed);
 void* hash_table_remove(hash_table* h, char* key);
 void hash_table_resize(hash_table* h, unsigned long size);
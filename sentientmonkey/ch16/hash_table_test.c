@@ -36,5 +36,17 @@ int main() {
     hash_table_remove(h, "1");
     hash_table_print(h);
     hash_table_delete(h);
+
+    // with a limit, the least recently used entries go first
+    h = hash_table_new();
+    hash_table_register_print(h, int_print);
+    hash_table_set_limit(h, 5);
+    for(int i=0; i < 20; i++) {
+        sprintf(buff, "%i", i);
+        hash_table_add(h, buff, &(ints[i]));
+        hash_table_get(h, "0");
+    }
+    hash_table_print(h);
+    hash_table_delete(h);
     return 0;
 }
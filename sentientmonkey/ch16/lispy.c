@@ -1,7 +1,15 @@
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE     /* mmap, see jit_compile */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#include <sys/mman.h>
 
 #include <editline/readline.h>
 #include "mpc.h"
@@ -15,17 +23,15 @@
 #define STR_CONTAINS(A,B)   (strstr(A,B))
 #define MIN(X,Y)    ((X < Y) ? X : Y)
 #define MAX(X,Y)    ((X > Y) ? X : Y)
-#define LCHECK(args, cond, fmt, ...) \
+#define LCHECK(cond, fmt, ...) \
     if (!(cond)) {\
-        lval* err = lval_err(fmt, ##__VA_ARGS__);\
-        lval_del(args);\
-        return err;\
+        return lval_err(fmt, ##__VA_ARGS__);\
     }
 
 #define LCHECK_TYPE(func, arg, t) \
-   LCHECK(arg, (arg->type == t), \
+   LCHECK((LTYPE(arg) == t), \
        "Function '%s' passed incorrect type. Got %s, Expected %s", \
-       func, ltype_name(arg->type), ltype_name(t));
+       func, ltype_name(LTYPE(arg)), ltype_name(t));
 
 #define LCHECK_ALL_TYPES(func, arg, t) \
     for (int i=0; i < arg->count; i++) { \
@@ -33,12 +39,12 @@
     }
 
 #define LCHECK_COUNT(func, arg, n) \
-   LCHECK(arg, (arg->count == n), \
+   LCHECK((arg->count == n), \
        "Function '%s' passed incorrect number of arguments! Got %i, Expected %i.", \
        func, a->count, n);
 
 #define LCHECK_EMPTY(func, arg) \
-    LCHECK(arg, (arg->count != 0), \
+    LCHECK((arg->count != 0), \
         "Function '%s' passed {}!", \
         func);
 
@@ -47,6 +53,9 @@ struct lval;
 struct lenv;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct vm_ins vm_ins;
+typedef struct cnode cnode;
+typedef struct memo memo;
 
 /* creating enums without typedef feels wrong, so I added them. */
 typedef enum { LVAL_ERR, LVAL_NUM, LVAL_DUB, LVAL_SYM, LVAL_STR, LVAL_FUN,
@@ -54,28 +63,347 @@ typedef enum { LVAL_ERR, LVAL_NUM, LVAL_DUB, LVAL_SYM, LVAL_STR, LVAL_FUN,
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+/* arithmetic kernels, see builtin_arith */
+typedef int(*arith_num)(long*, lval**, int);
+typedef int(*arith_dub)(double*, lval**, int);
+
 struct lval {
-    lval_type_t type;
-
-    /* basic */
-    long num;
-    double dub;
-    char* err;
-    char* sym;
-    char* str;
-
-    /* function */
-    lbuiltin builtin;
-    char* fname;
+    unsigned char type; /* lval_type_t, a byte so the header stays small */
+
+    /* values are shared freely between envs, args and bodies, so treat
+     * anything you didn't just create as immutable. the gc frees them. */
+    unsigned char marked;
+    unsigned short flags;
+
+    /* expressions: how far cell has stepped past popped front cells.
+     * lambdas: how many formals come before any '&', see lval_arity, and
+     * calls so far, see jit_call. they live up here because the header
+     * has room for them. */
+    union {
+        int off;
+        struct {
+            short arity;
+            unsigned char hot;
+        };
+    };
+
+    lval* gc_next;
+
+    /* only one of these is live at a time, picked by type. functions are
+     * the odd one out: check LVAL_IS_BUILTIN before touching either half. */
+    union {
+        /* basic */
+        long num;
+        double dub;
+        char* err;
+        char* str;
+
+        /* symbol. slot says where lenv_lookup should look first */
+        struct {
+            char* sym;
+            int slot;
+        };
+
+        /* function. memo is only set on what memo returns, see memo_call */
+        struct {
+            lbuiltin builtin;
+            char* fname;
+            memo* memo;
+        };
+        struct {
+            lenv* env;
+            lval* formals;
+            lval* body;
+        };
+
+        /* expression. cap is how many cells are allocated. popping the
+         * front just steps cell forward, see off. a slice borrows cells
+         * from its owner's array and owns nothing itself. anything else
+         * that has been run by the vm keeps its compiled code, or its
+         * closure tree if it's a lambda body (see LFLAG_CNODE), or else
+         * what its macros expand to (see LFLAG_EXPANDED). */
+        struct {
+            int count;
+            int cap;
+            lval** cell;
+            union {
+                lval* owner;
+                vm_ins* code;
+                cnode* node;
+                lval* expansion;
+            };
+        };
+    };
+};
+
+/* smallest cell array an expression allocates */
+#define LVAL_MIN_CAP 4
+
+#define LFLAG_BUILTIN 1
+#define LFLAG_SLICE 2
+#define LFLAG_SEEN 4    /* evaluated as code once, see vm_warm */
+#define LFLAG_SIMPLE 8  /* lambda with distinct formals and no '&' */
+#define LFLAG_CNODE 16  /* body compiled to closures, see cnode_compile */
+#define LFLAG_VARIADIC 32   /* lambda whose formals end in '& rest' */
+#define LFLAG_BADFORMALS 64 /* lambda with a '&' not before a last formal */
+#define LFLAG_FOLDED 128    /* body from lval_fold, see lval_fold_lambda */
+#define LFLAG_MACRO 256     /* lambda from defmacro */
+#define LFLAG_EXPANDED 512  /* expansion kept, see lval_expand_keep */
+#define LVAL_IS_BUILTIN(v) ((v)->flags & LFLAG_BUILTIN)
+#define LVAL_IS_MEMO(v) (LVAL_IS_BUILTIN(v) && (v)->memo != NULL)
+#define LVAL_IS_SLICE(v) ((v)->flags & LFLAG_SLICE)
+
+/* keep lval from quietly growing back. bump this on purpose if you must. */
+#define LVAL_MAX_SIZE 40
+typedef char lval_size_check[(sizeof(lval) <= LVAL_MAX_SIZE) ? 1 : -1];
+
+/* immediates. heap lvals are at least 8 byte aligned, which leaves the low
+ * bits of an lval* free to mean "this isn't actually a pointer":
+ *
+ *   ...xx1  fixnum: the long itself, shifted left one
+ *   ...010  flonum: a double with its exponent squeezed into 8 bits
+ *   ...000  pointer to a heap lval
+ *
+ * so numbers never touch the heap. longs that need all 64 bits and doubles
+ * outside roughly 1e-38..1e38 still get boxed as LVAL_NUM/LVAL_DUB. always
+ * go through LTYPE/LNUM/LDUB when a value might be a number. */
+#define LVAL_INT_MAX    (INTPTR_MAX >> 1)
+#define LVAL_INT_MIN    (INTPTR_MIN >> 1)
+#define LVAL_FLO_TAG    2
+#define LVAL_FLO_BIAS   ((uint64_t)(1023 - 127) << 53)
+
+#define LVAL_IS_INT(v)  ((uintptr_t)(v) & 1)
+#define LVAL_IS_FLO(v)  (((uintptr_t)(v) & 7) == LVAL_FLO_TAG)
+#define LVAL_IS_IMM(v)  ((uintptr_t)(v) & 3)
+
+#define LTYPE(v) (LVAL_IS_INT(v) ? LVAL_NUM : \
+                  LVAL_IS_FLO(v) ? LVAL_DUB : (v)->type)
+#define LNUM(v)  (LVAL_IS_INT(v) ? ((intptr_t)(v) >> 1) : (v)->num)
+#define LDUB(v)  (LVAL_IS_FLO(v) ? lval_flo_decode(v) : (v)->dub)
+
+/* slab allocator. the evaluator churns through lvals and call frames, so
+ * rather than a malloc/free per object each type gets a pool that carves
+ * fixed size slabs into a free list. freed objects go back on the list,
+ * slabs are never handed back.
+ *
+ * build with -DPOOL_MALLOC to go straight to malloc/free, which keeps
+ * valgrind and asan able to see each object. */
+#define POOL_SLAB_OBJECTS 1024
+
+typedef struct pool_obj {
+    struct pool_obj* next;
+} pool_obj;
+
+typedef struct {
+    size_t size;        /* object size, at least a pointer */
+    pool_obj* free;
+    long slabs;
+    long live;          /* handed out and not yet returned */
+} pool;
+
+/* symbols are interned: every symbol with the same name shares one string,
+ * so two symbols are equal exactly when their sym pointers are. the hash
+ * is worked out once and kept just in front of the name. */
+typedef struct {
+    unsigned long hash;
+    int global_slot;    /* where it was last put in global_env, or -1 */
+    int locals;         /* ever bound anywhere but global_env */
+    int frames;         /* frames binding it the gc hasn't freed yet */
+    int defs;           /* times bound in global_env */
+    int folded;         /* code has been folded with its binding */
+    char name[];
+} lsym;
+
+#define LSYM(s) ((lsym*)((s) - offsetof(lsym, name)))
+#define SYM_HASH(s) (LSYM(s)->hash)
+
+hash_table* symbols = NULL;
+char* sym_amp;
+char* sym_and;
+char* sym_or;
+char* sym_do;
+char* sym_if;
+char* sym_fun;
+
+/* symbol slots, see lval_resolve. anything >= 0 is a slot in the frame */
+#define LSLOT_UNRESOLVED -1
+#define LSLOT_GLOBAL -2
+
+/* the tree walker's stack (see lval_eval_tree). each frame is an
+ * S-Expression part way through having its cells evaluated. */
+typedef struct {
     lenv* env;
-    lval* formals;
-    lval* body;
+    lval* v;
+    lval* a;        /* values of v's cells so far */
+    int i;          /* next cell of v to evaluate */
+    int own;        /* env is a call frame made for this code alone */
+    lval* memo;     /* memos to keep the result in, see memo_enter */
+} eval_frame;
+
+/* frames of either evaluator, see max-depth */
+#define EVAL_MAX_DEPTH 100000
+/* C calls into lval_eval_tree and vm_run inside one another. they only
+ * nest when a builtin or cold code hands back to the other evaluator */
+#define EVAL_MAX_NESTING 1000
+
+typedef struct {
+    eval_frame* frames;
+    int count;
+    int cap;
+    int max_depth;
+    int nesting;
+} eval_state;
+
+eval_state ev = { NULL, 0, 0, EVAL_MAX_DEPTH, 0 };
+
+/* bytecode for the vm (see vm_run). an expression compiles to its cells
+ * in order, nested S-expressions inline, then an OP_APPLY that does what
+ * eval_apply would with the values on the stack. a do leaves its last
+ * form unevaluated for OP_DO instead, see vm_do. a && or || has an
+ * OP_LAZY before its last cell, which jumps past the rest if its first
+ * arg settles it, see lval_lazy. */
+typedef enum { OP_CONST, OP_LOOKUP, OP_APPLY, OP_DO, OP_LAZY, OP_RETURN } vm_op_t;
+
+struct vm_ins {
+    vm_op_t op;
+    int n;          /* OP_APPLY, OP_DO: number of cells, function included.
+                       OP_LAZY: number of instructions to skip */
+    lval* x;        /* OP_CONST: the value. OP_LOOKUP: the symbol */
+};
+
+typedef struct {
+    vm_ins* pc;
+    lenv* env;
+    int base;       /* where this frame's values start on gc.roots */
+    int own;        /* env is a call frame made for this code alone */
+} vm_frame;
 
-    /* expression */
+typedef struct {
+    int enabled;    /* --vm */
+    vm_frame* frames;
     int count;
-    lval** cell;
+    int cap;
+} vm_state;
+
+vm_state vm = { 0, NULL, 0, 0 };
+
+/* lambda bodies compiled to a tree of closures (see cnode_compile), each
+ * node a function that runs that one piece of the body. */
+typedef struct {
+    lenv* env;
+    cnode* node;
+    lval* body;     /* the lambda body node belongs to, to keep it rooted */
+    int own;        /* env is a call frame made for body alone */
+} cnode_tail;
+
+/* runs n in e. with t it's in tail position, and rather than making a
+ * call it can set t to what should run next and return NULL */
+typedef lval*(*cnode_fn)(lenv* e, cnode* n, cnode_tail* t);
+
+struct cnode {
+    cnode_fn run;
+    lval* x;        /* the value, symbol or expression it was built from */
+    int slot;       /* cnode_local: where x is expected in the frame */
+    int count;
+    cnode** cells;
+};
+
+int cnode_enabled = 0;  /* --closures */
+
+/* the function memo wrapped and the results of its calls so far, keyed by
+ * their args, see memo_call */
+#define MEMO_LIMIT 10000
+
+struct memo {
+    lval* f;
+    hash_table* cache;  /* memo_key -> lval*, least recently used go first */
+    long hits;
+    long misses;
 };
 
+/* a string being built up a bit at a time, see memo_key */
+typedef struct {
+    char* s;
+    size_t len;
+    size_t cap;
+} strbuf;
+
+/* native code for hot lambdas, see jit_call. x86-64 only. --no-jit turns
+ * it off. */
+#define JIT_HOT 100         /* calls to a lambda before it's compiled */
+#define JIT_NEVER 254       /* lval.hot: its body can't be, or kept bailing */
+#define JIT_NATIVE 255      /* lval.hot: compiled, see jit_find */
+#define JIT_MAX_DEPTH 10000 /* native self calls deep before giving up */
+#define JIT_BUCKETS 256
+
+/* runs a compiled body on its args, at most budget self calls deep.
+ * NULL if it bailed out. */
+typedef lval*(*jit_entry)(lval** args, long budget);
+
+typedef struct jit_fn {
+    lval* f;
+    jit_entry run;
+    size_t size;        /* of the mapping run points into */
+    long epoch;         /* folds.epoch when it was compiled */
+    int bails;          /* on its args, less the calls it finished */
+    struct jit_fn* next;
+} jit_fn;
+
+typedef struct {
+    int enabled;
+    int deep;           /* the last bail was for running out of budget */
+    int floor;          /* see jit_call */
+    jit_fn* fns[JIT_BUCKETS];   /* by lambda */
+} jit_state;
+
+jit_state jit = { 1, 0, INT_MAX, { NULL } };
+
+/* a body part way through being compiled, see jit_compile */
+typedef struct {
+    strbuf code;
+    lval* f;
+    int nargs;
+    size_t bail;        /* offsets into code of the labels jumps go to */
+    size_t bail_deep;
+    size_t body;        /* start of the body's own function */
+    size_t top;         /* just after its prologue, for tail calls */
+} jit_asm;
+
+/* a fun definition lispy --compile turned into C, see aot_install */
+typedef struct {
+    int form;           /* the top-level form that defines it */
+    jit_entry run;
+    lbuiltin* ops;      /* filled in with what syms are bound to */
+    char** syms;        /* the globals it was compiled against */
+    char** fnames;      /* the builtin each has to be, NULL for itself */
+} aot_native;
+
+/* a fun definition part way through being written out as C */
+#define AOT_MAX_GLOBALS 32
+
+typedef struct {
+    strbuf code;
+    int form;
+    char* name;
+    lval* formals;
+    int temps;
+    int tail_calls;
+    char* syms[AOT_MAX_GLOBALS];    /* see aot_native */
+    char* fnames[AOT_MAX_GLOBALS];
+    int nsyms;
+} aot_fn;
+
+/* constant folding, see lval_fold. only done with --fold, or with
+ * --dump-folds, which also prints each form it changes. */
+typedef struct {
+    int enabled;
+    int dump;
+    long epoch;     /* bumped whenever a name code was folded with is bound */
+    long macros;    /* bumped by defmacro, see lval_expand_epoch */
+} fold_state;
+
+fold_state folds = { 0, 0, 0, 0 };
+
 mpc_parser_t* Number;
 mpc_parser_t* Double;
 mpc_parser_t* Symbol;
@@ -111,31 +439,140 @@ char* ltype_name(lval_type_t t) {
     }
 }
 
+void* pool_alloc(pool* p) {
+    p->live++;
+#ifdef POOL_MALLOC
+    return malloc(p->size);
+#else
+    if (p->free == NULL) {
+        char* slab = malloc(p->size * POOL_SLAB_OBJECTS);
+        for (int i=POOL_SLAB_OBJECTS-1; i >= 0; i--) {
+            pool_obj* o = (pool_obj*)(slab + i * p->size);
+            o->next = p->free;
+            p->free = o;
+        }
+        p->slabs++;
+    }
+    pool_obj* o = p->free;
+    p->free = o->next;
+    return o;
+#endif
+}
+
+void pool_release(pool* p, void* x) {
+    p->live--;
+#ifdef POOL_MALLOC
+    free(x);
+#else
+    pool_obj* o = x;
+    o->next = p->free;
+    p->free = o;
+#endif
+}
+
+/* fraction of the slab space in use, 1.0 with no slabs (or -DPOOL_MALLOC) */
+double pool_occupancy(pool* p) {
+    if (p->slabs == 0) {
+        return 1.0;
+    }
+    return (double)p->live / (p->slabs * POOL_SLAB_OBJECTS);
+}
+
+pool lval_pool = { sizeof(lval), NULL, 0, 0 };
+
+/* most cell and binding arrays are argument lists and call frames with a
+ * few entries, so arrays up to POOL_ARRAY_CAP pointers come from a pool
+ * too. resizes an array of cap pointers to new_cap, 0 frees it. */
+#define POOL_ARRAY_CAP 4
+
+pool array_pool = { sizeof(void*) * POOL_ARRAY_CAP, NULL, 0, 0 };
+
+void* pool_array_resize(void* p, int cap, int new_cap) {
+    int pooled = cap > 0 && cap <= POOL_ARRAY_CAP;
+    int new_pooled = new_cap > 0 && new_cap <= POOL_ARRAY_CAP;
+
+    if (pooled && new_pooled) {
+        return p;
+    }
+    if (!pooled && !new_pooled) {
+        if (new_cap == 0) {
+            free(p);
+            return NULL;
+        }
+        return realloc(p, sizeof(void*) * new_cap);
+    }
+
+    void* q = NULL;
+    if (new_pooled) {
+        q = pool_alloc(&array_pool);
+    } else if (new_cap > 0) {
+        q = malloc(sizeof(void*) * new_cap);
+    }
+    if (p) {
+        memcpy(q, p, sizeof(void*) * MIN(cap, new_cap));
+    }
+    if (pooled) {
+        pool_release(&array_pool, p);
+    } else {
+        free(p);
+    }
+    return q;
+}
+
 lval* lval_new(lval_type_t type) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = pool_alloc(&lval_pool);
+    memset(v, 0, sizeof(lval));
     v->type = type;
-    v->num = 0;
-    v->dub = 0.0;
-    v->err = NULL;
-    v->sym = NULL;
-    v->builtin = NULL;
-    v->fname = NULL;
-    v->env = NULL;
-    v->formals = NULL;
-    v->body = NULL;
-
-    v->count = 0;
-    v->cell = NULL;
+
+    gc_track_lval(v);
     return v;
 }
 
 lval* lval_num(long x) {
+    if (x >= LVAL_INT_MIN && x <= LVAL_INT_MAX) {
+        return (lval*)(((uintptr_t)x << 1) | 1);
+    }
     lval* v = lval_new(LVAL_NUM);
     v->num = x;
     return v;
 }
 
+/* rotate the sign down to bit 0 so the exponent sits on top, then rebase
+ * the exponent. anything that doesn't leave the top 3 bits clear won't fit.
+ * +-0.0 get the two encodings that would otherwise mean +-2^-127. */
+lval* lval_flo_encode(double x) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+
+    uint64_t r = (bits << 1) | (bits >> 63);
+    if ((r >> 1) == 0) {
+        return (lval*)(uintptr_t)((r << 3) | LVAL_FLO_TAG);
+    }
+
+    r -= LVAL_FLO_BIAS;
+    if ((r >> 61) != 0 || (r >> 1) == 0) {
+        return NULL;
+    }
+    return (lval*)(uintptr_t)((r << 3) | LVAL_FLO_TAG);
+}
+
+double lval_flo_decode(lval* v) {
+    uint64_t r = (uint64_t)(uintptr_t)v >> 3;
+    if ((r >> 1) != 0) {
+        r += LVAL_FLO_BIAS;
+    }
+    uint64_t bits = (r >> 1) | (r << 63);
+
+    double x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
 lval* lval_dub(double x) {
+    lval* f = lval_flo_encode(x);
+    if (f != NULL) {
+        return f;
+    }
     lval* v = lval_new(LVAL_DUB);
     v->dub = x;
     return v;
@@ -159,22 +596,68 @@ lval* lval_err(char* fmt, ...) {
 
 lval* lval_fun(char* s, lbuiltin builtin) {
     lval* v = lval_new(LVAL_FUN);
+    v->flags = LFLAG_BUILTIN;
     v->builtin = builtin;
     v->fname = strdup(s);
     return v;
 }
 
+/* f with a cache of up to limit results in front of it. it's a builtin
+ * that only lval_builtin_call knows how to call. */
+lval* lval_memo(lval* f, long limit) {
+    memo* m = malloc(sizeof(memo));
+    m->f = f;
+    m->cache = hash_table_new();
+    hash_table_set_limit(m->cache, limit);
+    m->hits = 0;
+    m->misses = 0;
+
+    lval* v = lval_fun("memo", NULL);
+    v->memo = m;
+    return v;
+}
+
 lval* lval_lambda(lval* formals, lval* body) {
     lval* v = lval_new(LVAL_FUN);
     v->env = lenv_new();
     v->body = body;
     v->formals = formals;
+    lval_arity(v);
     return v;
 }
 
+/* names live as long as the program, there aren't many of them */
+char* sym_intern(char* s) {
+    if (symbols == NULL) {
+        symbols = hash_table_new();
+        sym_amp = sym_intern("&");
+        sym_and = sym_intern("&&");
+        sym_or = sym_intern("||");
+        sym_do = sym_intern("do");
+        sym_if = sym_intern("if");
+        sym_fun = sym_intern("fun");
+    }
+
+    unsigned long h = hash(s);
+    lsym* x = hash_table_get_hashed(symbols, s, h);
+    if (x == NULL) {
+        x = malloc(sizeof(lsym) + strlen(s) + 1);
+        x->hash = h;
+        x->global_slot = -1;
+        x->locals = 0;
+        x->frames = 0;
+        x->defs = 0;
+        x->folded = 0;
+        strcpy(x->name, s);
+        hash_table_add_hashed(symbols, s, x, h);
+    }
+    return x->name;
+}
+
 lval* lval_sym(char* s) {
     lval* v = lval_new(LVAL_SYM);
-    v->sym = strdup(s);
+    v->sym = sym_intern(s);
+    v->slot = LSLOT_UNRESOLVED;
     return v;
 }
 
@@ -196,111 +679,131 @@ lval* lval_ok(void) {
     return lval_sym("ok");
 }
 
+/* only the gc calls this. frees v itself, not the values it points at */
 void lval_del(lval* v) {
     switch (v->type) {
         case LVAL_NUM:
         case LVAL_DUB:
             break;
+        case LVAL_SYM:
+            /* names are interned and never freed */
+            break;
         case LVAL_FUN:
-            if (!v->builtin) {
-                lenv_del(v->env);
-                lval_del(v->formals);
-                lval_del(v->body);
+            if (LVAL_IS_BUILTIN(v)) {
+                free(v->fname);
+                if (v->memo) {
+                    /* the results are the gc's to free */
+                    hash_table_delete(v->memo->cache);
+                    free(v->memo);
+                }
+            } else if (v->hot == JIT_NATIVE) {
+                jit_forget(v);
             }
             break;
         case LVAL_ERR:
             free(v->err);
             break;
-        case LVAL_SYM:
-            free(v->sym);
-            break;
         case LVAL_STR:
             free(v->str);
             break;
         case LVAL_QEXPR:
         case LVAL_SEXPR:
-            /* free all elements */
-            for (int i=0; i < v->count; i++) {
-                lval_del(v->cell[i]);
+            /* fee memory for pointers, unless they're borrowed */
+            if (!LVAL_IS_SLICE(v)) {
+                pool_array_resize(v->cell - v->off, v->cap, 0);
+                lval_uncompile(v);
             }
-            /* fee memory for pointers */
-            free(v->cell);
             break;
     }
     /* free lval struct */
-    free(v);
+    pool_release(&lval_pool, v);
 }
 
-lval* lval_add(lval* v, lval* x) {
-    v->count++;
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    v->cell[v->count-1] = x;
-    return v;
+/* give v its own array of cap cells with cell[0] at the start. a slice
+ * copies its cells out, anything else slides down over popped cells. */
+void lval_resize(lval* v, int cap) {
+    if (LVAL_IS_SLICE(v)) {
+        lval** cell = pool_array_resize(NULL, 0, cap);
+        memcpy(cell, v->cell, sizeof(lval*) * v->count);
+        v->cell = cell;
+        v->flags &= ~LFLAG_SLICE;
+    } else {
+        lval** base = v->cell - v->off;
+        memmove(base, v->cell, sizeof(lval*) * v->count);
+        v->cell = pool_array_resize(base, v->cap, cap);
+        lval_uncompile(v);
+    }
+    v->code = NULL;
+    v->off = 0;
+    v->cap = cap;
 }
 
-lval* lval_copy(lval* v) {
-    lval* x = lval_new(v->type);
+/* frees whatever v was compiled to, by the vm or cnode_compile. a kept
+ * expansion is the gc's to free, it's just dropped. */
+void lval_uncompile(lval* v) {
+    if (v->flags & LFLAG_CNODE) {
+        cnode_del(v->node);
+    } else if (!(v->flags & LFLAG_EXPANDED)) {
+        free(v->code);
+    }
+    v->flags &= ~(LFLAG_CNODE | LFLAG_EXPANDED);
+    v->code = NULL;
+}
 
-    switch (v->type) {
-        case LVAL_FUN:
-            if (v->builtin) {
-                x-> builtin = v->builtin;
-                x->fname = strdup(v->fname);
-            } else {
-                x->env = lenv_copy(v->env);
-                x->formals = lval_copy(v->formals);
-                x->body = lval_copy(v->body);
-            }
-            break;
-        case LVAL_NUM:
-            x->num = v->num;
-            break;
-        case LVAL_DUB:
-            x->dub = v->dub;
-            break;
-        case LVAL_ERR:
-            x->err = strdup(v->err);
-            break;
-        case LVAL_SYM:
-            x->sym = strdup(v->sym);
-            break;
-        case LVAL_STR:
-            x->str = strdup(v->str);
-            break;
-        case LVAL_SEXPR:
-        case LVAL_QEXPR:
-            x->count = v->count;
-            x->cell = malloc(sizeof(lval*) * x->count);
-            for (int i=0; i < x->count; i++) {
-                x->cell[i] = lval_copy(v->cell[i]);
-            }
-            break;
+/* the cells of x from i on. they're shared instead of copied: x can't
+ * change under us, values are immutable once built. */
+lval* lval_slice(lval* x, int i) {
+    lval* v = lval_new(x->type);
+    v->flags |= LFLAG_SLICE;
+    v->owner = LVAL_IS_SLICE(x) ? x->owner : x;
+    v->cell = x->cell + i;
+    v->count = x->count - i;
+    return v;
+}
+
+/* make room for at least n cells. grows geometrically so a run of adds
+ * only reallocs O(log n) times, and doubles rather than just sliding down
+ * while the list is over half full so pop-front/add-back stays cheap. */
+void lval_reserve(lval* v, int n) {
+    if (!LVAL_IS_SLICE(v) && v->off + n <= v->cap) {
+        return;
+    }
+    int cap = MAX(LVAL_MIN_CAP, v->cap);
+    while (cap < n || cap < v->count * 2) {
+        cap *= 2;
     }
+    lval_resize(v, cap);
+}
 
-    return x;
+lval* lval_add(lval* v, lval* x) {
+    lval_reserve(v, v->count+1);
+    v->cell[v->count++] = x;
+    return v;
 }
 
 int lval_eq(lval* x, lval* y) {
-    if (x->type != y->type) {
+    if (LTYPE(x) != LTYPE(y)) {
         return 0;
     } else {
-        switch(x->type) {
+        switch(LTYPE(x)) {
             case LVAL_NUM:
-                return (x->num == y->num);
+                return (LNUM(x) == LNUM(y));
             case LVAL_DUB:
-                return (x->dub == y->dub);
+                return (LDUB(x) == LDUB(y));
             case LVAL_ERR:
                 return STR_EQ(x->err, y->err);
             case LVAL_SYM:
-                return STR_EQ(x->sym, y->sym);
+                return (x->sym == y->sym);
             case LVAL_STR:
                 return STR_EQ(x->str, y->str);
             case LVAL_FUN:
-                if (x->builtin || y->builtin) {
-                    return (x->builtin == y->builtin);
+                if (LVAL_IS_BUILTIN(x) || LVAL_IS_BUILTIN(y)) {
+                    return (LVAL_IS_BUILTIN(x) && LVAL_IS_BUILTIN(y) &&
+                            x->builtin == y->builtin && x->memo == y->memo);
                 } else {
                     return (lval_eq(x->formals, y->formals) &&
-                            lval_eq(x->body, y->body));
+                            lval_eq(lval_unfolded(x->body),
+                                    lval_unfolded(y->body)));
                 }
             case LVAL_SEXPR:
             case LVAL_QEXPR:
@@ -340,7 +843,7 @@ lval* lval_read_dub(mpc_ast_t* t) {
 
 lval* lval_read_str(mpc_ast_t* t) {
     /* trim quotes */
-    char* unescaped = malloc(strlen(t->contents)-2);
+    char* unescaped = malloc(strlen(t->contents)-1);
     strlcpy(unescaped, (t->contents+1), strlen(t->contents)-1);
 
     unescaped = mpcf_unescape(unescaped);
@@ -411,24 +914,28 @@ void lval_print_str(lval* v) {
 }
 
 void lval_print(lval* v) {
-    switch (v->type) {
+    switch (LTYPE(v)) {
         case LVAL_NUM:
-            printf("%li", v->num);
+            printf("%li", LNUM(v));
             break;
         case LVAL_DUB:
-            printf("%g", v->dub);
+            printf("%g", LDUB(v));
             break;
         case LVAL_ERR:
             printf("Error: %s", v->err);
             break;
         case LVAL_FUN:
-            if (v->builtin) {
+            if (LVAL_IS_MEMO(v)) {
+                printf("(memo ");
+                lval_print(v->memo->f);
+                putchar(')');
+            } else if (LVAL_IS_BUILTIN(v)) {
                 printf("<%s>", v->fname);
             } else {
                 printf("(\\");
                 lval_print(v->formals);
                 putchar(' ');
-                lval_print(v->body);
+                lval_print(lval_unfolded(v->body));
                 putchar(')');
             }
             break;
@@ -454,62 +961,125 @@ void lval_println(lval* v) {
 
 lval* lval_pop(lval* v, int i) {
     lval* x = v->cell[i];
-    memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
 
+    if (i == 0) {
+        v->cell++;
+        if (!LVAL_IS_SLICE(v)) {
+            v->off++;
+        }
+    } else {
+        if (LVAL_IS_SLICE(v)) {
+            lval_resize(v, v->count);
+        }
+        memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
+    }
     v->count--;
 
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+    /* only give memory back once we're down to a quarter, so popping and
+     * adding around a boundary doesn't realloc every time */
+    if (!LVAL_IS_SLICE(v) && v->cap > LVAL_MIN_CAP && v->count < v->cap / 4) {
+        lval_resize(v, v->cap / 2);
+    }
 
     return x;
 }
 
-lval* lval_take(lval* v, int i) {
-    lval* x = lval_pop(v, i);
-    lval_del(v);
-    return x;
-}
+/* frames with more symbols than this get a hash index. local frames
+ * usually hold a handful of formals, where a strcmp scan beats hashing. */
+#define LENV_HASH_THRESHOLD 16
+
+/* call frames are sized for their formals up front, so this is small */
+#define LENV_MIN_CAP 2
+
+/* the env builtins were added to, the root of every frame chain */
+lenv* global_env = NULL;
 
 struct lenv {
     lenv* parent;
     int count;
-    char** syms;
+    int cap;            /* slots allocated in syms and vals */
+    char** syms;        /* interned, see sym_intern */
     lval** vals;
+    hash_table* index; /* sym -> slot+1, NULL while the frame is small */
+    int global;         /* bindings here don't count towards lsym frames */
+
+    int marked;
+    lenv* gc_next;
 };
 
+pool lenv_pool = { sizeof(lenv), NULL, 0, 0 };
+
 lenv* lenv_new(void) {
-    lenv* e = malloc(sizeof(lenv));
+    lenv* e = pool_alloc(&lenv_pool);
     e->parent = NULL;
     e->count = 0;
+    e->cap = 0;
     e->syms = NULL;
     e->vals = NULL;
+    e->index = NULL;
+    e->global = 0;
+
+    gc_track_lenv(e);
     return e;
 }
 
+/* slots are stored off by one so a miss (NULL) can't collide with slot 0 */
+void lenv_index_slot(lenv* e, int i) {
+    hash_table_add_hashed(e->index, e->syms[i], (void*)(long)(i+1),
+            SYM_HASH(e->syms[i]));
+}
+
+void lenv_index(lenv* e) {
+    e->index = hash_table_new();
+    for (int i=0; i < e->count; i++) {
+        lenv_index_slot(e, i);
+    }
+}
+
+int lenv_find(lenv* e, char* sym) {
+    if (e->index) {
+        return (long)hash_table_get_hashed(e->index, sym, SYM_HASH(sym)) - 1;
+    }
+    for (int i=0; i < e->count; i++) {
+        if (e->syms[i] == sym) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 /* so I guess this makes a copy of the current environment to create a
  * lexical scope within functions. Seems like this could happen later
  * (on writing new values) for a big performance gain for many functions.
  */
-lenv* lenv_copy(lenv* e) {
+/* extra is how many more bindings to leave room for */
+lenv* lenv_copy(lenv* e, int extra) {
     lenv* n = lenv_new();
     n->parent = e->parent;
+    lenv_reserve(n, e->count + extra);
     n->count = e->count;
-    n->syms = malloc(sizeof(char*) * n->count);
-    n->vals = malloc(sizeof(lval*) * n->count);
     for (int i=0; i < e->count; i++) {
-        n->syms[i] = strdup(e->syms[i]);
-        n->vals[i] = lval_copy(e->vals[i]);
+        n->syms[i] = e->syms[i];
+        n->vals[i] = e->vals[i];
+        LSYM(n->syms[i])->frames++;
+    }
+    if (e->index) {
+        lenv_index(n);
     }
     return n;
 }
 
+/* only the gc calls this. the values are collected on their own */
 void lenv_del(lenv* e) {
-    for (int i=0; i < e->count; i++) {
-        free(e->syms[i]);
-        lval_del(e->vals[i]);
+    for (int i=0; i < e->count && !e->global; i++) {
+        LSYM(e->syms[i])->frames--;
     }
-    free(e->syms);
-    free(e->vals);
-    free(e);
+    pool_array_resize(e->syms, e->cap, 0);
+    pool_array_resize(e->vals, e->cap, 0);
+    if (e->index) {
+        hash_table_delete(e->index);
+    }
+    pool_release(&lenv_pool, e);
 }
 
 void lenv_print_val(char* sym, lval* v) {
@@ -525,11 +1095,9 @@ void lenv_print(lenv* e) {
 }
 
 lval* lenv_get(lenv* e, lval* k) {
-    /* linear scan, not cool bro. */
-    for (int i=0; i < e->count; i++) {
-        if STR_EQ(e->syms[i], k->sym) {
-            return lval_copy(e->vals[i]);
-        }
+    int i = lenv_find(e, k->sym);
+    if (i >= 0) {
+        return e->vals[i];
     }
     if (e->parent) {
         return lenv_get(e->parent, k);
@@ -538,22 +1106,83 @@ lval* lenv_get(lenv* e, lval* k) {
     }
 }
 
+/* room for n bindings, growing geometrically like lval_reserve */
+void lenv_reserve(lenv* e, int n) {
+    if (n <= e->cap) {
+        return;
+    }
+    int cap = MAX(LENV_MIN_CAP, e->cap * 2);
+    while (cap < n) {
+        cap *= 2;
+    }
+    e->vals = pool_array_resize(e->vals, e->cap, cap);
+    e->syms = pool_array_resize(e->syms, e->cap, cap);
+    e->cap = cap;
+}
+
+/* s is being bound somewhere. anything folded with the binding it had
+ * has to go back to its unfolded code, see lval_body. */
+void lsym_rebind(lsym* s) {
+    if (s->folded) {
+        s->folded = 0;
+        folds.epoch++;
+    }
+}
+
 void lenv_put(lenv* e, lval* k, lval* v) {
-    for (int i=0; i < e->count; i++) {
-        if STR_EQ(e->syms[i], k->sym) {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
-        }
+    lsym_rebind(LSYM(k->sym));
+    if (e == global_env) {
+        LSYM(k->sym)->defs++;
+    }
+
+    int i = lenv_find(e, k->sym);
+    if (i >= 0) {
+        e->vals[i] = v;
+        return;
     }
 
     /* create new entry */
+    lenv_reserve(e, e->count+1);
     e->count++;
-    e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-    e->syms = realloc(e->syms, sizeof(char*) * e->count);
 
-    e->vals[e->count-1] = lval_copy(v);
-    e->syms[e->count-1] = strdup(k->sym);
+    e->vals[e->count-1] = v;
+    e->syms[e->count-1] = k->sym;
+
+    if (e == global_env) {
+        LSYM(k->sym)->global_slot = e->count-1;
+    } else {
+        LSYM(k->sym)->locals = 1;
+    }
+    if (!e->global) {
+        LSYM(k->sym)->frames++;
+    }
+
+    if (e->index) {
+        lenv_index_slot(e, e->count-1);
+    } else if (e->count > LENV_HASH_THRESHOLD) {
+        lenv_index(e);
+    }
+}
+
+/* the fast paths lval_resolve set up for k, falling back to lenv_get.
+ * a slot is only a hint: the same body can run in a frame it wasn't
+ * resolved for (let, a body shared between lambdas), so check the name. */
+lval* lenv_lookup(lenv* e, lval* k) {
+    if (k->slot >= 0) {
+        if (k->slot < e->count && e->syms[k->slot] == k->sym) {
+            return e->vals[k->slot];
+        }
+    } else if (k->slot == LSLOT_GLOBAL) {
+        /* scope is dynamic, so any caller's frame could shadow a global.
+         * that can only happen to a name a frame still around binds. */
+        lsym* s = LSYM(k->sym);
+        if (!s->frames && s->global_slot >= 0 &&
+                s->global_slot < global_env->count &&
+                global_env->syms[s->global_slot] == k->sym) {
+            return global_env->vals[s->global_slot];
+        }
+    }
+    return lenv_get(e, k);
 }
 
 void lenv_def(lenv* e, lval* k, lval* v) {
@@ -563,179 +1192,446 @@ void lenv_def(lenv* e, lval* k, lval* v) {
     lenv_put(e, k, v);
 }
 
-lval* builtin_op_num(lval* x, char* op, lval* y) {
-    if ((STR_EQ("/", op) || STR_EQ("%", op)) && (y->num == 0)) {
-        lval_del(x);
-        lval_del(y);
-        return lval_err("Divde By Zero!");
-    }
-
-    if (STR_EQ(op, "+")) {
-        x->num += y->num;
-    } else if (STR_EQ(op, "-")) {
-        x->num -= y->num;
-    } else if (STR_EQ(op, "*")) {
-        x->num *= y->num;
-    } else if (STR_EQ(op, "/")) {
-        x->num /= y->num;
-    } else if (STR_EQ(op, "%")) {
-        x->num %= y->num;
-    } else if (STR_EQ(op, "^")) {
-        x->num = pow(x->num, y->num);
-    } else if (STR_EQ(op, "min")) {
-        x->num = MIN(x->num, y->num);
-    } else if (STR_EQ(op, "max")) {
-        x->num = MAX(x->num, y->num);
-    } else {
-        lval_del(x);
-        lval_del(y);
-        return lval_err("Invalid operator!");
+/* mark and sweep garbage collector. every lval and lenv is threaded onto
+ * a heap list when it's created and is only ever freed by gc_sweep.
+ *
+ * collection only happens at safe points (see lval_eval_tree and vm_run),
+ * so any value a C function still needs across a call back into the
+ * evaluator has to be reachable from a root: the global env, the frames
+ * and forms being evaluated, and whatever load or the REPL are working
+ * through. */
+#define GC_MIN_THRESHOLD 10000
+#define GC_GROWTH 2.0
+#define GC_MARKED 1
+#define GC_PINNED 2         /* kept for its slices, cells unmarked, see gc_pin */
+
+typedef struct {
+    lval* lvals;
+    lenv* lenvs;
+    long count;         /* objects on the heap lists */
+    long threshold;     /* collect when count passes this */
+    double growth;      /* next threshold is survivors * growth */
+
+    lval** roots;
+    int nroots;
+    int roots_cap;
+    lenv** env_roots;
+    int nenv_roots;
+    int env_roots_cap;
+
+    /* last collection */
+    long collected;
+    double pause_ms;
+} gc_heap;
+
+gc_heap gc = { NULL, NULL, 0, GC_MIN_THRESHOLD, GC_GROWTH,
+               NULL, 0, 0, NULL, 0, 0, 0, 0.0 };
+
+void gc_track_lval(lval* v) {
+    v->marked = 0;
+    v->gc_next = gc.lvals;
+    gc.lvals = v;
+    gc.count++;
+}
+
+void gc_track_lenv(lenv* e) {
+    e->marked = 0;
+    e->gc_next = gc.lenvs;
+    gc.lenvs = e;
+    gc.count++;
+}
+
+void gc_push(lval* v) {
+    if (gc.nroots == gc.roots_cap) {
+        gc.roots_cap = MAX(16, gc.roots_cap * 2);
+        gc.roots = realloc(gc.roots, sizeof(lval*) * gc.roots_cap);
     }
-    lval_del(y);
+    gc.roots[gc.nroots++] = v;
+}
 
-    return x;
+void gc_pop(int n) {
+    gc.nroots -= n;
 }
 
-// still lots of duplication :(
-lval* builtin_op_dub(lval* x, char* op, lval* y) {
-    if ((STR_EQ("/", op) || STR_EQ("%", op)) && (y->dub == 0)) {
-        lval_del(x);
-        lval_del(y);
-        return lval_err("Divide By Zero!");
+void gc_push_env(lenv* e) {
+    if (gc.nenv_roots == gc.env_roots_cap) {
+        gc.env_roots_cap = MAX(16, gc.env_roots_cap * 2);
+        gc.env_roots = realloc(gc.env_roots, sizeof(lenv*) * gc.env_roots_cap);
     }
+    gc.env_roots[gc.nenv_roots++] = e;
+}
 
-    if (STR_EQ(op, "+")) {
-        x->dub += y->dub;
-    } else if (STR_EQ(op, "-")) {
-        x->dub -= y->dub;
-    } else if (STR_EQ(op, "*")) {
-        x->dub *= y->dub;
-    } else if (STR_EQ(op, "/")) {
-        x->dub /= y->dub;
-    } else if (STR_EQ(op, "%")) {
-        x->dub = fmod(x->dub, y->dub);
-    } else if (STR_EQ(op, "^")) {
-        x->dub = pow(x->dub, y->dub);
-    } else if (STR_EQ(op, "min")) {
-        x->dub = MIN(x->dub, y->dub);
-    } else if (STR_EQ(op, "max")) {
-        x->dub = MAX(x->dub, y->dub);
-    } else {
-        lval_del(x);
-        lval_del(y);
-        return lval_err("Invalid operator!");
+void gc_pop_env(int n) {
+    gc.nenv_roots -= n;
+}
+
+void gc_mark_memo(memo* m) {
+    gc_mark_lval(m->f);
+    for (entry* x = m->cache->newest; x != NULL; x = x->older) {
+        gc_mark_lval(x->value);
     }
-    lval_del(y);
+}
 
-    return x;
+/* a slice's owner has to outlive it, but only the slice's own cells are
+ * reachable through it, and the slice marks those. walking every cell of
+ * the owner as well would make each collection cost the whole list while
+ * a loop tails down it. the owner is pinned instead, which still lets it
+ * be marked in full if it turns up some other way. */
+void gc_pin(lval* v) {
+    if (v->marked) {
+        return;
+    }
+    v->marked = GC_PINNED;
+    if (v->flags & LFLAG_FOLDED) {
+        gc_mark_lval(v->cell[v->count]);
+    }
+    if (v->flags & LFLAG_EXPANDED) {
+        gc_mark_lval(v->expansion);
+    }
 }
 
-lval* coerce_num_to_dub(lval* n) {
-    lval* d = lval_dub(n->num);
-    lval_del(n);
-    return d;
+void gc_mark_lval(lval* v) {
+    if (v == NULL || LVAL_IS_IMM(v) || v->marked == GC_MARKED) {
+        return;
+    }
+    v->marked = GC_MARKED;
+
+    switch (LTYPE(v)) {
+        case LVAL_FUN:
+            if (LVAL_IS_MEMO(v)) {
+                gc_mark_memo(v->memo);
+            } else if (!LVAL_IS_BUILTIN(v)) {
+                gc_mark_lenv(v->env);
+                gc_mark_lval(v->formals);
+                gc_mark_lval(v->body);
+            }
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            if (LVAL_IS_SLICE(v)) {
+                gc_pin(v->owner);
+            }
+            if (v->flags & LFLAG_FOLDED) {
+                gc_mark_lval(v->cell[v->count]);
+            }
+            if (v->flags & LFLAG_EXPANDED) {
+                gc_mark_lval(v->expansion);
+            }
+            for (int i=0; i < v->count; i++) {
+                gc_mark_lval(v->cell[i]);
+            }
+            break;
+        default:
+            break;
+    }
 }
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
-    /* validate numbers */
-    for (int i=0; i < a->count; i++) {
-        if ((a->cell[i]->type != LVAL_NUM) &&
-            (a->cell[i]->type != LVAL_DUB)) {
-            lval_del(a);
-            return lval_err("Cannot operator on non-number!");
+void gc_mark_lenv(lenv* e) {
+    /* walk up the parents here rather than recursing */
+    while (e != NULL && !e->marked) {
+        e->marked = 1;
+        for (int i=0; i < e->count; i++) {
+            gc_mark_lval(e->vals[i]);
         }
+        e = e->parent;
     }
+}
 
-    lval* x = lval_pop(a, 0);
+long gc_sweep(void) {
+    long freed = 0;
 
-    /* unary */
-    if (STR_EQ(op, "-") && a->count == 0) {
-        if (x->type == LVAL_NUM) {
-            x->num = -x->num;
+    lval** v = &gc.lvals;
+    while (*v) {
+        lval* x = *v;
+        if (x->marked) {
+            x->marked = 0;
+            v = &x->gc_next;
         } else {
-            x->dub = -x->dub;
+            *v = x->gc_next;
+            lval_del(x);
+            freed++;
         }
     }
 
-    while (a->count > 0) {
-        lval* y = lval_pop(a, 0);
-
-        // type coercion. doubles win.
-        if (x->type != y->type) {
-            if (x->type == LVAL_NUM) {
-                x = coerce_num_to_dub(x);
-            } else if (x->type == LVAL_DUB) {
-                y = coerce_num_to_dub(y);
-            }
+    lenv** e = &gc.lenvs;
+    while (*e) {
+        lenv* x = *e;
+        if (x->marked) {
+            x->marked = 0;
+            e = &x->gc_next;
+        } else {
+            *e = x->gc_next;
+            lenv_del(x);
+            freed++;
         }
+    }
+
+    gc.count -= freed;
+    return freed;
+}
+
+long gc_collect(void) {
+    clock_t start = clock();
+
+    for (int i=0; i < gc.nroots; i++) {
+        gc_mark_lval(gc.roots[i]);
+    }
+    for (int i=0; i < gc.nenv_roots; i++) {
+        gc_mark_lenv(gc.env_roots[i]);
+    }
+    for (int i=0; i < ev.count; i++) {
+        gc_mark_lenv(ev.frames[i].env);
+        gc_mark_lval(ev.frames[i].v);
+        gc_mark_lval(ev.frames[i].a);
+        gc_mark_lval(ev.frames[i].memo);
+    }
+
+    gc.collected = gc_sweep();
+    gc.threshold = MAX(GC_MIN_THRESHOLD, gc.count * gc.growth);
+    gc.pause_ms = (double)(clock() - start) * 1000 / CLOCKS_PER_SEC;
+
+    return gc.collected;
+}
 
-        if (x->type == LVAL_NUM) {
-            x = builtin_op_num(x, op, y);
-        } else if (x->type == LVAL_DUB) {
-            x = builtin_op_dub(x, op, y);
+void gc_maybe_collect(void) {
+#ifdef GC_STRESS
+    /* build with -DGC_STRESS to shake out values missing from the roots */
+    gc_collect();
+#else
+    if (gc.count > gc.threshold) {
+        gc_collect();
+    }
+#endif
+}
+
+/* arithmetic. each builtin is a pair of kernels, one for longs and one
+ * for doubles, that fold as many args into acc as they can in one tight
+ * loop and return how many that was. the long kernel stops at the first
+ * double, or an arg it can't apply without overflowing, and
+ * builtin_arith carries on from there in doubles. the double kernel only
+ * stops to divide by zero. */
+lval* builtin_arith(lval* a, char* name, arith_num num, arith_dub dub) {
+    for (int i=0; i < a->count; i++) {
+        if ((LTYPE(a->cell[i]) != LVAL_NUM) &&
+            (LTYPE(a->cell[i]) != LVAL_DUB)) {
+            return lval_err("Cannot operator on non-number!");
         }
-        if (x->type == LVAL_ERR) {
-            break;
+    }
+    LCHECK_EMPTY(name, a);
+
+    lval** args = a->cell + 1;
+    int n = a->count - 1;
+    double d;
+
+    if (LTYPE(a->cell[0]) == LVAL_NUM) {
+        long acc = LNUM(a->cell[0]);
+        int i = num(&acc, args, n);
+        if (i == n) {
+            return lval_num(acc);
         }
+        d = acc;
+        args += i;
+        n -= i;
+    } else {
+        d = LDUB(a->cell[0]);
     }
 
-    lval_del(a);
-    return x;
+    if (dub(&d, args, n) < n) {
+        return lval_err("Divide By Zero!");
+    }
+    return lval_dub(d);
 }
 
-lval* builtin_add(lenv* e, lval* a) {
-    return builtin_op(e, a, "+");
+double lval_to_dub(lval* v) {
+    return LTYPE(v) == LVAL_NUM ? LNUM(v) : LDUB(v);
 }
 
-lval* builtin_sub(lenv* e, lval* a) {
-    return builtin_op(e, a, "-");
+/* the loops the kernels share. step works out r from x and y, or breaks
+ * out if it can't. */
+#define ARITH_NUM_LOOP(step) \
+    long x = *acc; \
+    int i; \
+    for (i=0; i < n && LTYPE(args[i]) == LVAL_NUM; i++) { \
+        long y = LNUM(args[i]); \
+        long r; \
+        step \
+        x = r; \
+    } \
+    *acc = x; \
+    return i;
+
+#define ARITH_DUB_LOOP(step) \
+    double x = *acc; \
+    int i; \
+    for (i=0; i < n; i++) { \
+        double y = lval_to_dub(args[i]); \
+        step \
+    } \
+    *acc = x; \
+    return i;
+
+int arith_add_num(long* acc, lval** args, int n) {
+    ARITH_NUM_LOOP(if (__builtin_add_overflow(x, y, &r)) { break; })
 }
 
-lval* builtin_mul(lenv* e, lval* a) {
-    return builtin_op(e, a, "*");
+int arith_add_dub(double* acc, lval** args, int n) {
+    ARITH_DUB_LOOP(x += y;)
 }
 
-lval* builtin_div(lenv* e, lval* a) {
-    return builtin_op(e, a, "/");
+int arith_sub_num(long* acc, lval** args, int n) {
+    ARITH_NUM_LOOP(if (__builtin_sub_overflow(x, y, &r)) { break; })
 }
 
-lval* builtin_mod(lenv* e, lval* a) {
-    return builtin_op(e, a, "%");
+int arith_sub_dub(double* acc, lval** args, int n) {
+    ARITH_DUB_LOOP(x -= y;)
 }
 
-lval* builtin_pow(lenv* e, lval* a) {
-    return builtin_op(e, a, "^");
+int arith_mul_num(long* acc, lval** args, int n) {
+    ARITH_NUM_LOOP(if (__builtin_mul_overflow(x, y, &r)) { break; })
 }
 
-lval* builtin_min(lenv* e, lval* a) {
-    return builtin_op(e, a, "min");
+int arith_mul_dub(double* acc, lval** args, int n) {
+    ARITH_DUB_LOOP(x *= y;)
 }
 
-lval* builtin_max(lenv* e, lval* a) {
-    return builtin_op(e, a, "max");
+int arith_div_num(long* acc, lval** args, int n) {
+    ARITH_NUM_LOOP(
+        if (y == 0 || (x == LONG_MIN && y == -1)) {
+            break;
+        }
+        r = x / y;
+    )
 }
 
-lval* builtin_head(lenv* e, lval* a) {
-    LCHECK_COUNT("head", a, 1);
-    LCHECK_TYPE("head", a->cell[0], LVAL_QEXPR);
-    LCHECK_EMPTY("head", a->cell[0]);
+int arith_div_dub(double* acc, lval** args, int n) {
+    ARITH_DUB_LOOP(
+        if (y == 0) {
+            break;
+        }
+        x /= y;
+    )
+}
 
-    lval* v = lval_take(a, 0);
-    while (v->count > 1) {
-        lval_del(lval_pop(v, 1));
-    }
+int arith_mod_num(long* acc, lval** args, int n) {
+    ARITH_NUM_LOOP(
+        if (y == 0) {
+            break;
+        }
+        r = y == -1 ? 0 : x % y;
+    )
+}
 
-    return v;
+int arith_mod_dub(double* acc, lval** args, int n) {
+    ARITH_DUB_LOOP(
+        if (y == 0) {
+            break;
+        }
+        x = fmod(x, y);
+    )
 }
 
-lval* builtin_tail(lenv* e, lval* a) {
-    LCHECK_COUNT("tail", a, 1);
-    LCHECK_TYPE("tail", a->cell[0], LVAL_QEXPR);
-    LCHECK_EMPTY("tail", a->cell[0]);
+/* x to the y by squaring. 0 if that doesn't fit in a long, or is a
+ * fraction that integer division wouldn't round to 0. */
+int arith_ipow(long x, long y, long* r) {
+    if (y < 0) {
+        if (x == 0) {
+            return 0;
+        }
+        *r = x == 1 ? 1 : x == -1 ? (y & 1 ? -1 : 1) : 0;
+        return 1;
+    }
+    long p = 1;
+    while (y) {
+        if ((y & 1) && __builtin_mul_overflow(p, x, &p)) {
+            return 0;
+        }
+        y >>= 1;
+        if (y && __builtin_mul_overflow(x, x, &x)) {
+            return 0;
+        }
+    }
+    *r = p;
+    return 1;
+}
 
-    lval* v = lval_take(a, 0);
-    lval_del(lval_pop(v, 0));
-    return v;
+int arith_pow_num(long* acc, lval** args, int n) {
+    ARITH_NUM_LOOP(if (!arith_ipow(x, y, &r)) { break; })
+}
+
+int arith_pow_dub(double* acc, lval** args, int n) {
+    ARITH_DUB_LOOP(x = pow(x, y);)
+}
+
+int arith_min_num(long* acc, lval** args, int n) {
+    ARITH_NUM_LOOP(r = MIN(x, y);)
+}
+
+int arith_min_dub(double* acc, lval** args, int n) {
+    ARITH_DUB_LOOP(x = MIN(x, y);)
+}
+
+int arith_max_num(long* acc, lval** args, int n) {
+    ARITH_NUM_LOOP(r = MAX(x, y);)
+}
+
+int arith_max_dub(double* acc, lval** args, int n) {
+    ARITH_DUB_LOOP(x = MAX(x, y);)
+}
+
+lval* builtin_add(lenv* e, lval* a) {
+    return builtin_arith(a, "+", arith_add_num, arith_add_dub);
+}
+
+lval* builtin_sub(lenv* e, lval* a) {
+    /* unary minus */
+    if (a->count == 1 && LTYPE(a->cell[0]) == LVAL_NUM) {
+        long x = LNUM(a->cell[0]);
+        return x == LONG_MIN ? lval_dub(-(double)x) : lval_num(-x);
+    }
+    if (a->count == 1 && LTYPE(a->cell[0]) == LVAL_DUB) {
+        return lval_dub(-LDUB(a->cell[0]));
+    }
+    return builtin_arith(a, "-", arith_sub_num, arith_sub_dub);
+}
+
+lval* builtin_mul(lenv* e, lval* a) {
+    return builtin_arith(a, "*", arith_mul_num, arith_mul_dub);
+}
+
+lval* builtin_div(lenv* e, lval* a) {
+    return builtin_arith(a, "/", arith_div_num, arith_div_dub);
+}
+
+lval* builtin_mod(lenv* e, lval* a) {
+    return builtin_arith(a, "%", arith_mod_num, arith_mod_dub);
+}
+
+lval* builtin_pow(lenv* e, lval* a) {
+    return builtin_arith(a, "^", arith_pow_num, arith_pow_dub);
+}
+
+lval* builtin_min(lenv* e, lval* a) {
+    return builtin_arith(a, "min", arith_min_num, arith_min_dub);
+}
+
+lval* builtin_max(lenv* e, lval* a) {
+    return builtin_arith(a, "max", arith_max_num, arith_max_dub);
+}
+
+lval* builtin_head(lenv* e, lval* a) {
+    LCHECK_COUNT("head", a, 1);
+    LCHECK_TYPE("head", a->cell[0], LVAL_QEXPR);
+    LCHECK_EMPTY("head", a->cell[0]);
+
+    return lval_add(lval_qexpr(), a->cell[0]->cell[0]);
+}
+
+lval* builtin_tail(lenv* e, lval* a) {
+    LCHECK_COUNT("tail", a, 1);
+    LCHECK_TYPE("tail", a->cell[0], LVAL_QEXPR);
+    LCHECK_EMPTY("tail", a->cell[0]);
+
+    return lval_slice(a->cell[0], 1);
 }
 
 lval* builtin_list(lenv* e, lval* a) {
@@ -748,30 +1644,27 @@ lval* builtin_eval(lenv* e, lval* a) {
     LCHECK_COUNT("eval", a, 1);
     LCHECK_TYPE("eval", a->cell[0], LVAL_QEXPR);
 
-    lval* x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
-    return lval_eval(e, x);
+    return lval_eval_sexpr(e, a->cell[0]);
 }
 
 lval* builtin_join(lenv* e, lval* a) {
     LCHECK_ALL_TYPES("join", a, LVAL_QEXPR);
 
-    lval* x = lval_pop(a, 0);
+    lval* x = lval_qexpr();
 
-    while (a->count) {
-        x = lval_join(x, lval_pop(a, 0));
+    for (int i=0; i < a->count; i++) {
+        x = lval_join(x, a->cell[i]);
     }
 
-    lval_del(a);
     return x;
 }
 
 lval* lval_join(lval* x, lval* y) {
-    while (y->count) {
-        x = lval_add(x, lval_pop(y, 0));
+    lval_reserve(x, x->count + y->count);
+    for (int i=0; i < y->count; i++) {
+        x = lval_add(x, y->cell[i]);
     }
 
-    lval_del(y);
     return x;
 }
 
@@ -780,15 +1673,9 @@ lval* builtin_cons(lenv* e, lval* a) {
     LCHECK_TYPE("cons", a->cell[1], LVAL_QEXPR);
 
     lval* v = lval_qexpr();
-    lval* x = lval_pop(a, 0);
-    lval* y = lval_pop(a, 0);
-
-    v = lval_add(v,x);
-    while (y->count) {
-        v = lval_add(v, lval_pop(y, 0));
-    }
-
-    lval_del(a);
+    lval_reserve(v, a->cell[1]->count + 1);
+    v = lval_add(v, a->cell[0]);
+    v = lval_join(v, a->cell[1]);
 
     return v;
 }
@@ -797,15 +1684,7 @@ lval* builtin_len(lenv* e, lval* a) {
     LCHECK_COUNT("len", a, 1);
     LCHECK_TYPE("len", a->cell[0], LVAL_QEXPR);
 
-    lval* v = lval_num(0);
-    lval* x = lval_take(a, 0);
-    v->num = x->count;
-
-    while (x->count) {
-        lval_del(lval_pop(x, 0));
-    }
-
-    return v;
+    return lval_num(a->cell[0]->count);
 }
 
 /* this name is funky. when I think of init I think of initialize. */
@@ -813,14 +1692,16 @@ lval* builtin_init(lenv* e, lval* a) {
     LCHECK_COUNT("init", a, 1);
     LCHECK_TYPE("init", a->cell[0], LVAL_QEXPR);
 
-    lval* x = lval_take(a, 0);
+    lval* x = a->cell[0];
+    lval* v = lval_qexpr();
+    lval_reserve(v, x->count-1);
 
     /* if we get an empty list, return an empty list */
-    if (x->count > 0) {
-        lval_del(lval_pop(x, x->count-1));
+    for (int i=0; i < x->count-1; i++) {
+        v = lval_add(v, x->cell[i]);
     }
 
-    return x;
+    return v;
 }
 
 lval* builtin_env(lenv* e, lval* a) {
@@ -839,8 +1720,6 @@ lval* builtin_env(lenv* e, lval* a) {
         }
     }
 
-    lval_del(a);
-
     return lval_ok();
 }
 
@@ -848,11 +1727,10 @@ lval* builtin_exit(lenv* e, lval* a) {
     LCHECK_COUNT("exit", a, 1);
 
     /* evaluates arguments and exits with the resulting error code */
-    lval* x = lval_take(a, 0);
-    lval* result = lval_eval(e, x);
+    lval* result = lval_eval(e, a->cell[0]);
     LCHECK_TYPE("exit", result, LVAL_NUM);
     printf("Goodbye, cruel world.\n");
-    exit(result->num);
+    exit(LNUM(result));
 
     /*  no cleanup or return because fuck it, we're exiting. */
 }
@@ -863,14 +1741,60 @@ lval* builtin_lambda(lenv* e, lval* a) {
     LCHECK_TYPE("\\", a->cell[1], LVAL_QEXPR);
     LCHECK_ALL_TYPES("\\", a->cell[0], LVAL_SYM);
 
-    lval* formals = lval_pop(a, 0);
-    lval* body = lval_pop(a, 0);
-    lval_del(a);
+    lval* body = lval_expand(a->cell[1]);
+    lval_resolve(body, a->cell[0]);
+    lval* f = lval_lambda(a->cell[0], body);
+    if (folds.enabled) {
+        lval_fold_lambda(f);
+    }
+    if (cnode_enabled) {
+        cnode_compile(f->body);
+    }
+    return f;
+}
+
+/* (defmacro {name formals...} {body}): a global lambda that makes code,
+ * from the code it's called with. calls to it are replaced by what it
+ * makes when the code around them is loaded or made part of a lambda,
+ * see lval_expand. */
+lval* builtin_defmacro(lenv* e, lval* a) {
+    LCHECK_COUNT("defmacro", a, 2);
+    LCHECK_TYPE("defmacro", a->cell[0], LVAL_QEXPR);
+    LCHECK_TYPE("defmacro", a->cell[1], LVAL_QEXPR);
+    LCHECK_ALL_TYPES("defmacro", a->cell[0], LVAL_SYM);
+    LCHECK(a->cell[0]->count > 0, "Function 'defmacro' needs a name.");
+
+    lval* args = lval_add(lval_sexpr(), lval_slice(a->cell[0], 1));
+    lval* f = builtin_lambda(e, lval_add(args, a->cell[1]));
+    if (LTYPE(f) == LVAL_ERR) {
+        return f;
+    }
+    f->flags |= LFLAG_MACRO;
+    folds.macros++;
+    lenv_def(e, a->cell[0]->cell[0], f);
+    return lval_ok();
+}
+
+/* (macroexpand {code}): code with its macro calls expanded, itself
+ * included */
+lval* builtin_macroexpand(lenv* e, lval* a) {
+    LCHECK_COUNT("macroexpand", a, 1);
+    LCHECK_TYPE("macroexpand", a->cell[0], LVAL_QEXPR);
+
+    return lval_expand(a->cell[0]);
+}
+
+/* (code {f x...}): the S-Expression (f x...), as a value. lets a macro
+ * put calls together */
+lval* builtin_code(lenv* e, lval* a) {
+    LCHECK_COUNT("code", a, 1);
+    LCHECK_TYPE("code", a->cell[0], LVAL_QEXPR);
 
-    return lval_lambda(formals, body);
+    return lval_recast(a->cell[0], LVAL_SEXPR);
 }
 
 lval* builtin_var(lenv* e, lval* a, char* func) {
+    LCHECK_EMPTY(func, a);
     LCHECK_TYPE(func, a->cell[0], LVAL_QEXPR);
     lval* syms = a->cell[0];
     LCHECK_ALL_TYPES(func, syms, LVAL_SYM);
@@ -884,7 +1808,6 @@ lval* builtin_var(lenv* e, lval* a, char* func) {
         }
     }
 
-    lval_del(a);
     return lval_ok();
 }
 
@@ -900,30 +1823,27 @@ lval* builtin_ord(lenv* e, lval* a, char* op) {
     LCHECK_COUNT(op, a, 2);
     LCHECK_ALL_TYPES(op, a, LVAL_NUM);
 
-    lval* x = lval_pop(a, 0);
-    lval* y = lval_pop(a, 0);
+    lval* x = a->cell[0];
+    lval* y = a->cell[1];
 
     int result;
 
     if STR_EQ(op, ">") {
-        result = (x->num > y->num);
+        result = (LNUM(x) > LNUM(y));
     } else if STR_EQ(op, "<") {
-        result = (x->num < y->num);
+        result = (LNUM(x) < LNUM(y));
     } else if STR_EQ(op, ">=") {
-        result = (x->num >= y->num);
+        result = (LNUM(x) >= LNUM(y));
     } else if STR_EQ(op, "<=") {
-        result = (x->num <= y->num);
+        result = (LNUM(x) <= LNUM(y));
     } else if STR_EQ(op, "||") {
-        result = (x->num || y->num);
+        result = (LNUM(x) || LNUM(y));
     } else if STR_EQ(op, "&&") {
-        result = (x->num && y->num);
+        result = (LNUM(x) && LNUM(y));
     } else {
-        lval_del(a);
         return lval_err("Unknown operator!");
     }
 
-    lval_del(a);
-
     return lval_num(result);
 }
 
@@ -931,11 +1851,7 @@ lval* builtin_not(lenv* e, lval* a) {
     LCHECK_COUNT("!", a, 1);
     LCHECK_TYPE("!", a->cell[0], LVAL_NUM);
 
-    lval* x = lval_pop(a, 0);
-
-    int result = !x->num;
-
-    lval_del(a);
+    int result = !LNUM(a->cell[0]);
 
     return lval_num(result);
 }
@@ -968,20 +1884,17 @@ lval* builtin_and(lenv *e, lval* a) {
 lval* builtin_eq(lenv* e, lval* a) {
     LCHECK_COUNT("==", a, 2);
 
-    lval* x = lval_pop(a, 0);
-    lval* y = lval_pop(a, 0);
-
-    int result = lval_eq(x, y);
-
-    lval_del(a);
+    int result = lval_eq(a->cell[0], a->cell[1]);
 
     return lval_num(result);
 }
 
 lval* builtin_neq(lenv* e, lval* a) {
     lval* result = builtin_eq(e, a);
-    result->num = !result->num;
-    return result;
+    if (LTYPE(result) == LVAL_ERR) {
+        return result;
+    }
+    return lval_num(!LNUM(result));
 }
 
 lval* builtin_if(lenv* e, lval* a) {
@@ -990,58 +1903,193 @@ lval* builtin_if(lenv* e, lval* a) {
     LCHECK_TYPE("if", a->cell[1], LVAL_QEXPR);
     LCHECK_TYPE("if", a->cell[2], LVAL_QEXPR);
 
-    lval* cond = lval_pop(a, 0);
-    lval* left = lval_pop(a, 0);
-    lval* right = lval_pop(a, 0);
+    /* the branch is evaluated as code straight out of the Q-Expression */
+    lval* branch = LNUM(a->cell[0]) ? a->cell[1] : a->cell[2];
 
-    left->type = LVAL_SEXPR;
-    right->type = LVAL_SEXPR;
+    return lval_eval_sexpr(e, branch);
+}
 
-    lval* result;
-    if (cond->num) {
-        result = lval_eval(e, left);
-    } else {
-        result = lval_eval(e, right);
+/* (case x {key body...} ...) runs the body of the first clause whose key
+ * is == x, in e, the way if runs a branch. x is evaluated once, as an
+ * arg, and each key when it's reached. the evaluators run a body that's
+ * a single call in tail position, see lval_tail_code. */
+lval* builtin_case(lenv* e, lval* a) {
+    LCHECK((a->count > 0),
+        "Function 'case' passed incorrect number of arguments! Got %i, Expected at least %i.",
+        a->count, 1);
+    for (int i=1; i < a->count; i++) {
+        LCHECK_TYPE("case", a->cell[i], LVAL_QEXPR);
+        LCHECK_EMPTY("case", a->cell[i]);
     }
 
-    lval_del(a);
+    for (int i=1; i < a->count; i++) {
+        lval* c = a->cell[i];
+        lval* key = lval_eval(e, c->cell[0]);
+        if (LTYPE(key) == LVAL_ERR) {
+            return key;
+        }
+        if (!lval_eq(a->cell[0], key)) {
+            continue;
+        }
+        if (c->count == 2) {
+            return lval_eval(e, c->cell[1]);
+        }
+        lval* body = lval_slice(c, 1);
+        gc_push(body);
+        lval* r = lval_eval_sexpr(e, body);
+        gc_pop(1);
+        return r;
+    }
+    return lval_err("No Case Found");
+}
 
-    return result;
+/* the evaluators run the last form of a do in its place, in tail
+ * position, so this only sees a do that ends in a plain value */
+lval* builtin_do(lenv* e, lval* a) {
+    if (a->count == 0) {
+        return lval_qexpr();
+    }
+    return a->cell[a->count-1];
 }
 
-lval* builtin_load(lenv* e, lval* a) {
-    LCHECK_COUNT("load", a, 1);
-    LCHECK_TYPE("load", a->cell[0], LVAL_STR);
+/* runs the body in a fresh frame, so = binds there. the evaluators run it
+ * in tail position, see lval_tail_code. */
+lval* builtin_let(lenv* e, lval* a) {
+    LCHECK_COUNT("let", a, 1);
+    LCHECK_TYPE("let", a->cell[0], LVAL_QEXPR);
 
-    mpc_result_t r;
-    if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
-        lval* expr = lval_read(r.output);
-        mpc_ast_delete(r.output);
+    lenv* env = lenv_new();
+    env->parent = e;
+    return lval_eval_sexpr(env, a->cell[0]);
+}
 
-        while (expr->count) {
-            lval* x = lval_eval(e, lval_pop(expr, 0));
-            if (x->type == LVAL_ERR) {
-                lval_println(x);
-            }
-            lval_del(x);
+/* the loops run their body as code once a pass, the way if runs a
+ * branch, and stop at the first error. a loop variable is bound in the
+ * env the loop runs in, the way = would, and updated there each pass. */
+lval* builtin_while(lenv* e, lval* a) {
+    LCHECK_COUNT("while", a, 2);
+    LCHECK_TYPE("while", a->cell[0], LVAL_QEXPR);
+    LCHECK_TYPE("while", a->cell[1], LVAL_QEXPR);
+
+    while (1) {
+        lval* c = lval_eval_sexpr(e, a->cell[0]);
+        if (LTYPE(c) == LVAL_ERR) {
+            return c;
+        }
+        LCHECK_TYPE("while", c, LVAL_NUM);
+        if (!LNUM(c)) {
+            return lval_ok();
+        }
+
+        lval* r = lval_eval_sexpr(e, a->cell[1]);
+        if (LTYPE(r) == LVAL_ERR) {
+            return r;
+        }
+    }
+}
+
+lval* builtin_dotimes(lenv* e, lval* a) {
+    LCHECK_COUNT("dotimes", a, 3);
+    LCHECK_TYPE("dotimes", a->cell[0], LVAL_QEXPR);
+    LCHECK(a->cell[0]->count == 1,
+            "Function 'dotimes' binds one name. Got %i.", a->cell[0]->count);
+    LCHECK_TYPE("dotimes", a->cell[0]->cell[0], LVAL_SYM);
+    LCHECK_TYPE("dotimes", a->cell[1], LVAL_NUM);
+    LCHECK_TYPE("dotimes", a->cell[2], LVAL_QEXPR);
+
+    lval* sym = a->cell[0]->cell[0];
+    for (long i=0; i < LNUM(a->cell[1]); i++) {
+        lenv_put(e, sym, lval_num(i));
+        lval* r = lval_eval_sexpr(e, a->cell[2]);
+        if (LTYPE(r) == LVAL_ERR) {
+            return r;
         }
+    }
+    return lval_ok();
+}
 
-        lval_del(expr);
-        lval_del(a);
+/* over the cells of a Q-Expression or the characters of a string */
+lval* builtin_for_each(lenv* e, lval* a) {
+    LCHECK_COUNT("for-each", a, 3);
+    LCHECK_TYPE("for-each", a->cell[0], LVAL_QEXPR);
+    LCHECK(a->cell[0]->count == 1,
+            "Function 'for-each' binds one name. Got %i.", a->cell[0]->count);
+    LCHECK_TYPE("for-each", a->cell[0]->cell[0], LVAL_SYM);
+    LCHECK(LTYPE(a->cell[1]) == LVAL_QEXPR || LTYPE(a->cell[1]) == LVAL_STR,
+            "Function 'for-each' passed incorrect type. Got %s, Expected %s or %s",
+            ltype_name(LTYPE(a->cell[1])), ltype_name(LVAL_QEXPR),
+            ltype_name(LVAL_STR));
+    LCHECK_TYPE("for-each", a->cell[2], LVAL_QEXPR);
+
+    lval* sym = a->cell[0]->cell[0];
+    lval* l = a->cell[1];
+    long n = LTYPE(l) == LVAL_STR ? strlen(l->str) : l->count;
+    for (long i=0; i < n; i++) {
+        if (LTYPE(l) == LVAL_STR) {
+            char c[2] = { l->str[i], '\0' };
+            lenv_put(e, sym, lval_str(c));
+        } else {
+            lenv_put(e, sym, l->cell[i]);
+        }
+        lval* r = lval_eval_sexpr(e, a->cell[2]);
+        if (LTYPE(r) == LVAL_ERR) {
+            return r;
+        }
+    }
+    return lval_ok();
+}
 
-        return lval_ok();
+/* the forms in the file at path, or an error */
+lval* lval_read_file(char* path) {
+    mpc_result_t r;
+    if (mpc_parse_contents(path, Lispy, &r)) {
+        lval* expr = lval_read(r.output);
+        mpc_ast_delete(r.output);
+        return expr;
     } else {
         char* err_msg = mpc_err_string(r.error);
         mpc_err_delete(r.error);
 
         lval* err = lval_err("Could not load Library %s", err_msg);
         free(err_msg);
-        lval_del(a);
 
         return err;
     }
 }
 
+/* evaluates a top-level form the way load does, printing any error */
+void lval_run_form(lenv* e, lval* x) {
+    x = lval_expand_form(x);
+    if (folds.enabled) {
+        x = lval_fold_form(x);
+    }
+    gc_push(x);
+    x = lval_eval(e, x);
+    gc_pop(1);
+    if (LTYPE(x) == LVAL_ERR) {
+        lval_println(x);
+    }
+}
+
+lval* builtin_load(lenv* e, lval* a) {
+    LCHECK_COUNT("load", a, 1);
+    LCHECK_TYPE("load", a->cell[0], LVAL_STR);
+
+    lval* expr = lval_read_file(a->cell[0]->str);
+    if (LTYPE(expr) == LVAL_ERR) {
+        return expr;
+    }
+
+    gc_push(expr);
+    lval_resolve(expr, NULL);
+    for (int i=0; i < expr->count; i++) {
+        lval_run_form(e, expr->cell[i]);
+    }
+    gc_pop(1);
+
+    return lval_ok();
+}
+
 lval* builtin_print(lenv* e, lval* a) {
     for (int i=0; i < a->count; i++) {
         lval_print(a->cell[i]);
@@ -1055,16 +2103,14 @@ lval* builtin_print(lenv* e, lval* a) {
 
 lval* builtin_display(lenv* e, lval* a) {
     LCHECK_COUNT("display", a, 1);
-    lval* x = lval_pop(a, 0);
+    lval* x = a->cell[0];
 
-    if (x->type == LVAL_STR) {
+    if (LTYPE(x) == LVAL_STR) {
         printf("%s", x->str);
     } else {
         lval_print(x);
     }
 
-    lval_del(a);
-
     return lval_ok();
 }
 
@@ -1074,8 +2120,6 @@ lval* builtin_show(lenv* e, lval* a) {
 
     printf("%s\n", a->cell[0]->str);
 
-    lval_del(a);
-
     return lval_ok();
 }
 
@@ -1083,10 +2127,21 @@ lval* builtin_error(lenv* e, lval* a) {
     LCHECK_COUNT("error", a, 1);
     LCHECK_TYPE("error", a->cell[0], LVAL_STR);
 
-    lval* err = lval_err(a->cell[0]->str);
+    return lval_err(a->cell[0]->str);
+}
+
+/* (try {body} handler): the value of body, unless that's an error, in
+ * which case it's handler called on the error's message */
+lval* builtin_try(lenv* e, lval* a) {
+    LCHECK_COUNT("try", a, 2);
+    LCHECK_TYPE("try", a->cell[0], LVAL_QEXPR);
+    LCHECK_TYPE("try", a->cell[1], LVAL_FUN);
 
-    lval_del(a);
-    return err;
+    lval* r = lval_eval_sexpr(e, a->cell[0]);
+    if (LTYPE(r) != LVAL_ERR) {
+        return r;
+    }
+    return lval_call(e, a->cell[1], lval_add(lval_sexpr(), lval_str(r->err)));
 }
 
 lval* builtin_parse(lenv* e, lval* a) {
@@ -1099,6 +2154,7 @@ lval* builtin_parse(lenv* e, lval* a) {
 
     if (mpc_parse("<stdin>", a->cell[0]->str, Lispy, &r)) {
        x = lval_read(r.output);
+       mpc_ast_delete(r.output);
     } else {
         char* err_msg = mpc_err_string(r.error);
         x = lval_err(err_msg);
@@ -1106,8 +2162,6 @@ lval* builtin_parse(lenv* e, lval* a) {
         free(err_msg);
     }
 
-    lval_del(a);
-
     return x;
 }
 
@@ -1116,7 +2170,7 @@ lval* builtin_read(lenv* e, lval* a) {
     LCHECK_TYPE("read", a->cell[0], LVAL_STR);
 
     lval* x = builtin_parse(e, a);
-    if (x->type == LVAL_ERR) {
+    if (LTYPE(x) == LVAL_ERR) {
         return x;
     }
 
@@ -1129,17 +2183,17 @@ lval* builtin_read(lenv* e, lval* a) {
 lval* builtin_concat(lenv* e, lval* a) {
     LCHECK_ALL_TYPES("concat", a, LVAL_STR);
 
-    lval* s = lval_pop(a, 0);
-    lval* x;
-    if (a->count > 0) {
-        for (int i=0; i < a->count+1; i++) {
-            x = lval_pop(a, 0);
-            s->str = realloc(s->str, strlen(s->str)+strlen(x->str)+1);
-            strcat(s->str, x->str);
-        }
+    size_t len = 0;
+    for (int i=0; i < a->count; i++) {
+        len += strlen(a->cell[i]->str);
     }
 
-    lval_del(a);
+    lval* s = lval_new(LVAL_STR);
+    s->str = malloc(len+1);
+    s->str[0] = '\0';
+    for (int i=0; i < a->count; i++) {
+        strcat(s->str, a->cell[i]->str);
+    }
 
     return s;
 }
@@ -1148,11 +2202,12 @@ void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
     lval* k = lval_sym(name);
     lval* v = lval_fun(name, func);
     lenv_put(e, k, v);
-    lval_del(k);
-    lval_del(v);
 }
 
 void lenv_add_builtins(lenv* e) {
+    global_env = e;
+    e->global = 1;
+
     /* REPL functions */
     lenv_add_builtin(e, "exit", builtin_exit);
 
@@ -1161,6 +2216,7 @@ void lenv_add_builtins(lenv* e) {
     lenv_add_builtin(e, "def", builtin_def);
     lenv_add_builtin(e, "=", builtin_put);
     lenv_add_builtin(e, "env", builtin_env);
+    lenv_add_builtin(e, "let", builtin_let);
 
     /* Conditionals */
     lenv_add_builtin(e, ">", builtin_gt);
@@ -1173,12 +2229,22 @@ void lenv_add_builtins(lenv* e) {
     lenv_add_builtin(e, "==", builtin_eq);
     lenv_add_builtin(e, "!=", builtin_neq);
     lenv_add_builtin(e, "if", builtin_if);
+    lenv_add_builtin(e, "case", builtin_case);
+    lenv_add_builtin(e, "do", builtin_do);
+
+    /* Loops */
+    lenv_add_builtin(e, "while", builtin_while);
+    lenv_add_builtin(e, "dotimes", builtin_dotimes);
+    lenv_add_builtin(e, "for-each", builtin_for_each);
 
     /* List functions */
     lenv_add_builtin(e, "list", builtin_list);
     lenv_add_builtin(e, "head", builtin_head);
     lenv_add_builtin(e, "tail", builtin_tail);
     lenv_add_builtin(e, "eval", builtin_eval);
+    lenv_add_builtin(e, "defmacro", builtin_defmacro);
+    lenv_add_builtin(e, "macroexpand", builtin_macroexpand);
+    lenv_add_builtin(e, "code", builtin_code);
     lenv_add_builtin(e, "join", builtin_join);
     lenv_add_builtin(e, "cons", builtin_cons);
     lenv_add_builtin(e, "init", builtin_init);
@@ -1197,193 +2263,2888 @@ void lenv_add_builtins(lenv* e) {
     /* String functions */
     lenv_add_builtin(e, "load", builtin_load);
     lenv_add_builtin(e, "error", builtin_error);
+    lenv_add_builtin(e, "try", builtin_try);
     lenv_add_builtin(e, "print", builtin_print);
     lenv_add_builtin(e, "show", builtin_show);
     lenv_add_builtin(e, "read", builtin_read);
     lenv_add_builtin(e, "parse", builtin_parse);
     lenv_add_builtin(e, "display", builtin_display);
     lenv_add_builtin(e, "concat", builtin_concat);
-}
 
-lval* lval_eval_sexpr(lenv* e, lval* v) {
+    /* Memory */
+    lenv_add_builtin(e, "gc", builtin_gc);
+    lenv_add_builtin(e, "gc-growth", builtin_gc_growth);
 
-    for (int i=0; i < v->count; i++) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
-    }
-    for (int i=0; i < v->count; i++) {
-        if (v->cell[i]->type == LVAL_ERR) {
-            return lval_take(v, i);
-        }
-    }
+    /* Evaluation */
+    lenv_add_builtin(e, "max-depth", builtin_max_depth);
+    lenv_add_builtin(e, "memo", builtin_memo);
+    lenv_add_builtin(e, "memo-stats", builtin_memo_stats);
+}
 
-    if (v->count == 0) {
-        return v;
-    }
+/* whether v looks like a && or || with two args, which only needs the
+ * second if the first doesn't settle it */
+int lval_lazy_form(lval* v) {
+    return v->count == 3 && LTYPE(v->cell[0]) == LVAL_SYM &&
+        (v->cell[0]->sym == sym_and || v->cell[0]->sym == sym_or);
+}
 
-    if (v->count == 1) {
-        return lval_eval(e, lval_take(v, 0));
+/* the result of a lazy form from its first two values, the function and
+ * the first arg, if that's all it needs: && of 0 or || of anything else.
+ * otherwise NULL, and the last arg is evaluated and the call goes ahead
+ * as normal. */
+lval* lval_lazy(lval** v) {
+    if (LTYPE(v[0]) != LVAL_FUN || !LVAL_IS_BUILTIN(v[0]) ||
+            LTYPE(v[1]) != LVAL_NUM) {
+        return NULL;
     }
-
-    lval* f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN) {
-        lval* err = lval_err(
-                "S-expression starts with incorrect type. Got %s, Expected %s.",
-                ltype_name(f->type), ltype_name(LVAL_FUN));
-        lval_del(v);
-        lval_del(f);
-        return err;
+    if (v[0]->builtin == builtin_and && LNUM(v[1]) == 0) {
+        return lval_num(0);
     }
-
-    lval* result = lval_call(e, f, v);
-    lval_del(f);
-    return result;
+    if (v[0]->builtin == builtin_or && LNUM(v[1]) != 0) {
+        return lval_num(1);
+    }
+    return NULL;
 }
 
-lval* lval_eval(lenv* e, lval* v) {
-    if (v->type == LVAL_SYM) {
-        lval* x = lenv_get(e, v);
-        lval_del(v);
-        return x;
-    }
-    if (v->type == LVAL_SEXPR) {
-        return lval_eval_sexpr(e, v);
+/* evaluates the cells of v as code. v itself is left alone, so it can be
+ * a function body or a Q-Expression handed to eval/if. builtins nested
+ * deep (memo_call, map) get the tree walker, which runs memo calls
+ * without going back through C. */
+lval* lval_eval_sexpr(lenv* e, lval* v) {
+    if (vm.enabled && vm_warm(v) && !eval_nested_deep()) {
+        return vm_run(e, v);
     }
-    return v;
+    return lval_eval_tree(e, v);
 }
 
-lval* lval_call(lenv* e, lval* f, lval* a) {
-    if (f->builtin) {
-        return f->builtin(e, a);
+/* the tree walker proper. it keeps the S-Expressions it's part way
+ * through on ev.frames rather than recursing through C, so lispy code can
+ * recurse as deep as ev.max_depth allows. calls in tail position, the
+ * final call of a body, the branch of an if or eval, a let's body and the
+ * last form of a do, take over the frame that made them, so tail
+ * recursion doesn't grow the stack at all.
+ *
+ * an error in any cell is what every frame under it comes to, since
+ * applying values with an error among them gives the error. so the first
+ * one stops the frame it's in from evaluating anything else, and drops
+ * all the frames this call pushed in one go. */
+lval* lval_eval_tree(lenv* e, lval* v) {
+    lval* r = eval_enter();
+    if (r) {
+        return r;
+    }
+    if ((r = eval_push(e, v))) {
+        ev.nesting--;
+        return r;
     }
 
-    int given = a->count;
-    int total = f->formals->count;
-
-    while (a->count) {
-        if (f->formals->count == 0) {
-            lval_del(a);
-            return lval_err("Function passed too many arguments. \
-                    Got %i, Expected %i", given, total);
+    int bottom = ev.count-1;
+    while (1) {
+        eval_frame* fr = &ev.frames[ev.count-1];
+        lval* code = fr->v;
+        while (fr->i < code->count && LTYPE(code->cell[fr->i]) != LVAL_SEXPR) {
+            eval_arg(fr, lval_eval(fr->env, code->cell[fr->i++]));
         }
 
-        lval* sym = lval_pop(f->formals, 0);
+        /* safe point: everything live is reachable from the roots */
+        gc_maybe_collect();
 
-        /* special case for variable arguments */
-        if STR_EQ(sym->sym, "&") {
-            if (f->formals->count != 1) {
-                lval_del(a);
-                return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
+        if (fr->i < code->count) {
+            lval* x = code->cell[fr->i++];
+            if (fr->i == code->count && lval_do_last(fr->a->cell, fr->a->count)) {
+                eval_restart(fr, fr->env, x, fr->own);
+                continue;
+            }
+            if (vm.enabled && vm_warm(x) && !eval_nested_deep()) {
+                r = vm_run(fr->env, x);
+            } else if ((r = eval_push(fr->env, x)) == NULL) {
+                continue;
+            }
+            if (LTYPE(r) == LVAL_ERR) {
+                ev.count = bottom;
+                break;
             }
+            /* either can have moved the frames */
+            eval_arg(&ev.frames[ev.count-1], r);
+            continue;
+        }
 
-            lval* nsym = lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, a));
-            lval_del(sym);
-            lval_del(nsym);
+        r = eval_apply(fr);
+        if (r == NULL) {
+            continue;
+        }
+        if (LTYPE(r) == LVAL_ERR) {
+            ev.count = bottom;
             break;
         }
-
-        lval* val = lval_pop(a, 0);
-        lenv_put(f->env, sym, val);
-
-        lval_del(sym);
-        lval_del(val);
+        if (ev.frames[ev.count-1].memo) {
+            memo_keep(ev.frames[ev.count-1].memo, r);
+        }
+        if (--ev.count == bottom) {
+            break;
+        }
+        eval_arg(&ev.frames[ev.count-1], r);
     }
 
-    lval_del(a);
-
-    /* if '&' remains in formal list it should be bound to empty list */
-    if (f->formals->count > 0 &&
-            STR_EQ(f->formals->cell[0]->sym, "&")) {
-
-        if (f->formals->count != 2) {
-            return lval_err("Function formal invalid. Symbol '&' not followed by single symbol.");
-        }
+    ev.nesting--;
+    return r;
+}
 
-        lval_del(lval_pop(f->formals, 0));
+/* an error if there's no room for another frame. frames are the tree
+ * walker's and the vm's, plus calls the closure tier makes through C. */
+lval* eval_too_deep(void) {
+    if (ev.count + vm.count + ev.nesting >= ev.max_depth) {
+        return lval_err("Recursion too deep! Past max-depth of %i",
+                ev.max_depth);
+    }
+    return NULL;
+}
 
-        lval* sym = lval_pop(f->formals, 0);
-        lval* val = lval_qexpr();
+/* switching between the tree walker and the vm costs a C call, so past
+ * this each sticks to running things itself */
+int eval_nested_deep(void) {
+    return ev.nesting >= EVAL_MAX_NESTING / 2;
+}
 
-        lenv_put(f->env, sym, val);
-        lval_del(sym);
-        lval_del(val);
+/* counts a C call into one of the evaluators, see EVAL_MAX_NESTING */
+lval* eval_enter(void) {
+    if (ev.nesting == EVAL_MAX_NESTING) {
+        return lval_err("Recursion too deep! Past %i nested evaluations",
+                EVAL_MAX_NESTING);
     }
+    ev.nesting++;
+    return NULL;
+}
 
-    if (f->formals->count == 0) {
-        f->env->parent = e;
-        return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-    }  else { /* return partially evaluated function */
-        return lval_copy(f);
+lval* eval_push(lenv* e, lval* v) {
+    lval* err = eval_too_deep();
+    if (err) {
+        return err;
     }
+    if (ev.count == ev.cap) {
+        ev.cap = MAX(16, ev.cap * 2);
+        ev.frames = realloc(ev.frames, sizeof(eval_frame) * ev.cap);
+    }
+    ev.frames[ev.count++] = (eval_frame){ e, v, lval_sexpr(), 0, 0, NULL };
+    return NULL;
 }
 
+/* adds x to the values of fr, skipping the rest of its cells if x is an
+ * error or settles a lazy form */
+void eval_arg(eval_frame* fr, lval* x) {
+    lval_add(fr->a, x);
+    if (LTYPE(x) == LVAL_ERR || (fr->a->count == 2 &&
+                lval_lazy_form(fr->v) && lval_lazy(fr->a->cell))) {
+        fr->i = fr->v->count;
+    }
+}
 
-int main(int argc, char** argv) {
-    puts("Lispy Version 0.0.1");
-    puts("Press Ctrl+d to Exit\n");
-
-    Number   = mpc_new("number");
-    Double   = mpc_new("double");
-    Symbol   = mpc_new("symbol");
-    String   = mpc_new("string");
-    Comment  = mpc_new("comment");
-    Sexpr    = mpc_new("sexpr");
-    Qexpr    = mpc_new("qexpr");
-    Expr     = mpc_new("expr");
-    Lispy    = mpc_new("lispy");
+/* start fr over on v in e. its result is still the result of the call
+ * that started it, so it's still kept for any memo calls that did */
+void eval_restart(eval_frame* fr, lenv* e, lval* v, int own) {
+    *fr = (eval_frame){ e, v, lval_sexpr(), 0, own, fr->memo };
+}
 
-    mpca_lang(MPCA_LANG_DEFAULT,
-            "                                                                  \
-            double   : /-?[0-9]+\\.[0-9]+/ ;                                   \
-            number   : /-?[0-9]+/ ;                                            \
-            symbol   : /[a-zA-Z0-9_+i\\-*\\/%^\\\\=<>!\?&|]+/;                 \
-            string   : /\"(\\\\.|[^\"])*\"/ ;                                  \
-            comment  : /;[^\\r\\n]*/;                                          \
-            sexpr    : '(' <expr>* ')';                                        \
-            qexpr    : '{' <expr>* '}';                                        \
-            expr     : <double> | <number> | <symbol> | <string> | <comment> | <sexpr> | <qexpr> ; \
-            lispy    : /^/ <expr>* /$/ ;                                       \
-            ",
-            Number, Double, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+/* applies the values of a finished frame. returns the result, or NULL if
+ * fr has been restarted on the code that will produce it: that's any call
+ * a lambda body or if or eval would make in tail position. */
+lval* eval_apply(eval_frame* fr) {
+    lenv* e = fr->env;
+    lval* a = fr->a;
+    for (int i=0; i < a->count; i++) {
+        if (LTYPE(a->cell[i]) == LVAL_ERR) {
+            return a->cell[i];
+        }
+    }
 
-    lenv* e = lenv_new();
-    lenv_add_builtins(e);
+    /* cut short by eval_arg */
+    if (a->count < fr->v->count) {
+        return lval_lazy(a->cell);
+    }
 
-    /* load standard library */
-    lval* r = builtin_load(e, lval_add(lval_sexpr(), lval_str(STD_LIB)));
-    lval_del(r);
+    if (a->count == 0) {
+        return a;
+    }
 
-    if (argc == 1) {
-        while(1) {
-            char* input = readline("lispy> ");
-            add_history(input);
-            if (!input) { break; }
+    if (a->count == 1) {
+        lval* x = a->cell[0];
+        /* a lone builtin is a call with no arguments, e.g. (gc) */
+        if (LTYPE(x) == LVAL_FUN && LVAL_IS_BUILTIN(x)) {
+            lval_pop(a, 0);
+            return lval_builtin_call(e, x, a);
+        }
+        if (LTYPE(x) == LVAL_SEXPR) {
+            eval_restart(fr, e, x, fr->own);
+            return NULL;
+        }
+        return lval_eval(e, x);
+    }
 
-            lval* in = lval_add(lval_sexpr(), lval_str(input));
-            lval* x = builtin_parse(e, in);
-            x = lval_eval(e, x);
-            lval_println(x);
-            lval_del(x);
+    if (LTYPE(a->cell[0]) != LVAL_FUN) {
+        return lval_err(
+                "S-expression starts with incorrect type. Got %s, Expected %s.",
+                ltype_name(LTYPE(a->cell[0])), ltype_name(LVAL_FUN));
+    }
 
-            free(input);
+    lval* f = lval_pop(a, 0);
+    while (LVAL_IS_MEMO(f)) {
+        lval* r = memo_enter(fr, f, a);
+        if (r) {
+            return r;
+        }
+        f = f->memo->f;
+    }
+    if (LVAL_IS_BUILTIN(f)) {
+        lenv* env = e;
+        lval* code = lval_tail_code(f, a->cell, a->count, &env);
+        if (code == NULL) {
+            return lval_builtin_call(e, f, a);
         }
+        eval_restart(fr, env, code, env != e || fr->own);
+        return NULL;
+    }
+    if (f->flags & LFLAG_MACRO) {
+        return lval_macro_call(e, f, a);
     }
 
-    if (argc >= 2) {
-        for (int i=1; i < argc; i++) {
-            lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
-            lval* x = builtin_load(e, args);
+    lval* r = jit_call(f, a->cell, a->count);
+    if (r) {
+        return r;
+    }
 
-            if (x->type == LVAL_ERR) {
-                lval_println(x);
-            }
-            lval_del(x);
+    lval* body = lval_body(f);
+    lenv* env = e;
+    if (!fr->own || !lval_frame_reuse(e, f, a->cell, a->count)) {
+        if ((r = lval_bind(e, f, a, &env))) {
+            return r;
         }
     }
+    if ((body->flags & LFLAG_CNODE) && !eval_nested_deep()) {
+        return cnode_exec(env, body->node, body, 1);
+    }
+    /* a warm body runs in the vm, which then keeps any calls it makes,
+     * tail calls included, rather than handing each arg back here */
+    if (vm.enabled && vm_warm(body) && !eval_nested_deep()) {
+        return vm_run(env, body);
+    }
+    eval_restart(fr, env, body, 1);
+    return NULL;
+}
 
+/* the code if, eval or let would run for the count args, or NULL to call
+ * them as usual (which includes reporting errors). let sets *env to the
+ * frame its body runs in. */
+lval* lval_tail_code(lval* f, lval** args, int count, lenv** env) {
+    if (f->builtin == builtin_if && count == 3 &&
+            LTYPE(args[0]) == LVAL_NUM &&
+            LTYPE(args[1]) == LVAL_QEXPR && LTYPE(args[2]) == LVAL_QEXPR) {
+        return LNUM(args[0]) ? args[1] : args[2];
+    }
+    if (f->builtin == builtin_eval && count == 1 &&
+            LTYPE(args[0]) == LVAL_QEXPR) {
+        return args[0];
+    }
+    if (f->builtin == builtin_let && count == 1 &&
+            LTYPE(args[0]) == LVAL_QEXPR) {
+        lenv* frame = lenv_new();
+        frame->parent = *env;
+        *env = frame;
+        return args[0];
+    }
+    if (f->builtin == builtin_case) {
+        return lval_case_code(args, count);
+    }
+    return NULL;
+}
 
-    lenv_del(e);
-
+/* the call a case on args makes in tail position, found without running
+ * anything: every key up to the match has to be a literal, and its body
+ * a single S-Expression. NULL leaves the rest to builtin_case. */
+lval* lval_case_code(lval** args, int count) {
+    for (int i=1; i < count; i++) {
+        lval* c = args[i];
+        if (LTYPE(c) != LVAL_QEXPR || c->count == 0 ||
+                !lval_is_literal(c->cell[0])) {
+            return NULL;
+        }
+        if (lval_eq(args[0], c->cell[0])) {
+            return c->count == 2 && LTYPE(c->cell[1]) == LVAL_SEXPR ?
+                c->cell[1] : NULL;
+        }
+    }
+    return NULL;
+}
+
+/* whether the count values of a form so far are a do with no errors
+ * yet. its last form can run in place of the do rather than as an arg. */
+int lval_do_last(lval** v, int count) {
+    if (count == 0 || LTYPE(v[0]) != LVAL_FUN || !LVAL_IS_BUILTIN(v[0]) ||
+            v[0]->builtin != builtin_do) {
+        return 0;
+    }
+    for (int i=1; i < count; i++) {
+        if (LTYPE(v[i]) == LVAL_ERR) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* a lambda calling itself in tail position can rebind the frame it's
+ * running in rather than making a new one. scope is dynamic, so that's
+ * only invisible if the new bindings shadow everything in the old frame:
+ * f must be simple, get all its args, and bind exactly own's names. */
+int lval_frame_reuse(lenv* own, lval* f, lval** args, int count) {
+    int n = f->formals->count;
+    if (!(f->flags & LFLAG_SIMPLE) || count != n || own->count != n) {
+        return 0;
+    }
+    for (int i=0; i < n; i++) {
+        if (own->syms[i] != f->formals->cell[i]->sym) {
+            return 0;
+        }
+    }
+    for (int i=0; i < n; i++) {
+        own->vals[i] = args[i];
+    }
+    return 1;
+}
+
+/* where sym lands in the frame lval_bind builds for formals, or -1 */
+int lval_formal_slot(lval* formals, char* sym) {
+    int slot = 0;
+    for (int i=0; i < formals->count; i++) {
+        if (formals->cell[i]->sym == sym_amp) {
+            continue;
+        }
+        if (formals->cell[i]->sym == sym) {
+            return slot;
+        }
+        slot++;
+    }
+    return -1;
+}
+
+/* point the symbols in v at where they'll be found when v runs as the
+ * body of a function taking formals (NULL for top-level code): a formal's
+ * slot in the call frame, otherwise the global table. a nested lambda
+ * redoes its own body when it's built. */
+void lval_resolve(lval* v, lval* formals) {
+    switch (LTYPE(v)) {
+        case LVAL_SYM:
+            v->slot = formals ? lval_formal_slot(formals, v->sym) : -1;
+            if (v->slot < 0) {
+                v->slot = LSLOT_GLOBAL;
+            }
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i=0; i < v->count; i++) {
+                lval_resolve(v->cell[i], formals);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/* what folding can take sym to be: its value in global_env, as long as no
+ * frame has ever bound it to anything else. NULL if it can't say. */
+lval* lval_fold_global(char* sym) {
+    lsym* s = LSYM(sym);
+    if (global_env == NULL || s->locals || s->global_slot < 0 ||
+            s->global_slot >= global_env->count ||
+            global_env->syms[s->global_slot] != sym) {
+        return NULL;
+    }
+    return global_env->vals[s->global_slot];
+}
+
+/* builtins that only look at their args, so a call on literals always
+ * comes out the same */
+int lval_fold_pure(lbuiltin f) {
+    lbuiltin pure[] = {
+        builtin_add, builtin_sub, builtin_mul, builtin_div, builtin_mod,
+        builtin_pow, builtin_min, builtin_max, builtin_gt, builtin_lt,
+        builtin_gte, builtin_lte, builtin_eq, builtin_neq, builtin_not,
+        builtin_concat,
+    };
+    for (int i=0; i < sizeof(pure)/sizeof(pure[0]); i++) {
+        if (f == pure[i]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int lval_is_literal(lval* v) {
+    lval_type_t t = LTYPE(v);
+    return t == LVAL_NUM || t == LVAL_DUB || t == LVAL_STR;
+}
+
+/* whether cell i of the code v gets run: anything but a Q-Expression,
+ * which is data unless it's a branch of an if */
+int lval_fold_code(lval* v, int i) {
+    if (LTYPE(v->cell[i]) != LVAL_QEXPR) {
+        return 1;
+    }
+    if (i < 2 || LTYPE(v->cell[0]) != LVAL_SYM) {
+        return 0;
+    }
+    lval* f = lval_fold_global(v->cell[0]->sym);
+    return f && LTYPE(f) == LVAL_FUN && LVAL_IS_BUILTIN(f) &&
+        f->builtin == builtin_if;
+}
+
+/* what the call v folds to, or NULL: a pure builtin's value, or the
+ * branch an if on a literal would take, as an S-Expression */
+lval* lval_fold_call(lval* v) {
+    if (v->count == 0 || LTYPE(v->cell[0]) != LVAL_SYM) {
+        return NULL;
+    }
+    lval* f = lval_fold_global(v->cell[0]->sym);
+    if (f == NULL || LTYPE(f) != LVAL_FUN || !LVAL_IS_BUILTIN(f)) {
+        return NULL;
+    }
+
+    lval* r = NULL;
+    if (f->builtin == builtin_if) {
+        if (v->count == 4 && LTYPE(v->cell[1]) == LVAL_NUM &&
+                LTYPE(v->cell[2]) == LVAL_QEXPR &&
+                LTYPE(v->cell[3]) == LVAL_QEXPR) {
+            lval* branch = LNUM(v->cell[1]) ? v->cell[2] : v->cell[3];
+            r = lval_sexpr();
+            for (int i=0; i < branch->count; i++) {
+                lval_add(r, branch->cell[i]);
+            }
+        }
+    } else if (lval_fold_pure(f->builtin)) {
+        lval* a = lval_sexpr();
+        for (int i=1; i < v->count; i++) {
+            if (!lval_is_literal(v->cell[i])) {
+                return NULL;
+            }
+            lval_add(a, v->cell[i]);
+        }
+        /* errors are left for when the code runs */
+        r = f->builtin(global_env, a);
+        if (LTYPE(r) == LVAL_ERR) {
+            r = NULL;
+        }
+    }
+
+    if (r) {
+        LSYM(v->cell[0]->sym)->folded = 1;
+    }
+    return r;
+}
+
+/* whether sym turns up as data in v, somewhere it could be a name handed
+ * to def or = rather than code. code says if v itself gets run. */
+int lval_quotes(lval* v, char* sym, int code) {
+    switch (LTYPE(v)) {
+        case LVAL_SYM:
+            return !code && v->sym == sym;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i=0; i < v->count; i++) {
+                int run = code && lval_fold_code(v, i);
+                if (lval_quotes(v->cell[i], sym, run)) {
+                    return 1;
+                }
+            }
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+/* the code v, part of root, with calls to pure builtins on literals
+ * worked out and constants put in for their names. a constant is a name
+ * def'd just the once, to a literal, that root never quotes. v is left
+ * alone: expressions that change are copied, and if nothing does v comes
+ * back as is. folding assumes the bindings it used hold while the code
+ * runs. lsym_rebind notices when they don't, for code that hasn't started
+ * running yet. */
+lval* lval_fold(lval* root, lval* v) {
+    if (LTYPE(v) == LVAL_SYM) {
+        lval* x = lval_fold_global(v->sym);
+        if (x && LSYM(v->sym)->defs == 1 && lval_is_literal(x) &&
+                !lval_quotes(root, v->sym, 1)) {
+            LSYM(v->sym)->folded = 1;
+            return x;
+        }
+        return v;
+    }
+    if (LTYPE(v) != LVAL_SEXPR && LTYPE(v) != LVAL_QEXPR) {
+        return v;
+    }
+
+    lval* y = v;
+    for (int i=0; i < v->count; i++) {
+        if (!lval_fold_code(v, i)) {
+            continue;
+        }
+        lval* x = lval_fold(root, v->cell[i]);
+        if (x != v->cell[i]) {
+            if (y == v) {
+                y = lval_new(v->type);
+                for (int j=0; j < v->count; j++) {
+                    lval_add(y, v->cell[j]);
+                }
+            }
+            y->cell[i] = x;
+        }
+    }
+
+    lval* r = lval_fold_call(y);
+    if (r == NULL) {
+        return y;
+    }
+    /* a Q-Expression is a body or a branch, and has to stay one */
+    if (LTYPE(y) == LVAL_QEXPR) {
+        if (LTYPE(r) == LVAL_SEXPR) {
+            r->type = LVAL_QEXPR;
+            return r;
+        }
+        return lval_add(lval_qexpr(), r);
+    }
+    return r;
+}
+
+void lval_fold_dump(lval* v, lval* folded) {
+    if (folds.dump && folded != v) {
+        printf("fold: ");
+        lval_print(v);
+        printf(" => ");
+        lval_println(folded);
+    }
+}
+
+/* the top-level form v, folded */
+lval* lval_fold_form(lval* v) {
+    lval* x = lval_fold(v, v);
+    lval_fold_dump(v, x);
+    return x;
+}
+
+/* folds the body of the lambda f. the folded body keeps the body it came
+ * from, and the epoch it's good for, in the two cells just past its last,
+ * see lval_body. */
+void lval_fold_lambda(lval* f) {
+    lval* body = lval_fold(f->body, f->body);
+    if (body == f->body) {
+        return;
+    }
+    lval_fold_dump(f->body, body);
+    lval_reserve(body, body->count+2);
+    body->cell[body->count] = f->body;
+    body->cell[body->count+1] = lval_num(folds.epoch);
+    body->flags |= LFLAG_FOLDED;
+    f->body = body;
+}
+
+/* the body a call to f should run: the folded one, unless a name it was
+ * folded with has been bound again since */
+lval* lval_body(lval* f) {
+    lval* body = f->body;
+    if ((body->flags & LFLAG_FOLDED) &&
+            LNUM(body->cell[body->count+1]) != folds.epoch) {
+        return body->cell[body->count];
+    }
+    return body;
+}
+
+/* the code a body was folded from, or the body itself */
+lval* lval_unfolded(lval* body) {
+    return (body->flags & LFLAG_FOLDED) ? body->cell[body->count] : body;
+}
+
+/* macros. a call to one is replaced by the code it makes from the code
+ * it's called with, once, before anything runs: when a top-level form is
+ * loaded, and when a lambda is made, for its body. the expansion is kept
+ * on the expression it came from, so making the same lambda again is
+ * just a lookup. like folding, a macro has to be a global no frame has
+ * ever bound. calls that turn up some other way, in code built on the
+ * fly, still work, see lval_macro_call. */
+
+/* the macro v is a call to, or NULL */
+lval* lval_macro(lval* v) {
+    if (v->count == 0 || LTYPE(v->cell[0]) != LVAL_SYM) {
+        return NULL;
+    }
+    lval* m = lval_fold_global(v->cell[0]->sym);
+    if (m == NULL || LTYPE(m) != LVAL_FUN || LVAL_IS_BUILTIN(m) ||
+            !(m->flags & LFLAG_MACRO)) {
+        return NULL;
+    }
+    return m;
+}
+
+/* whether cell i of the code v is code too: anything lval_fold_code says
+ * is, and the Q-Expressions the other builtins that take code run */
+int lval_expand_code(lval* v, int i) {
+    if (lval_fold_code(v, i)) {
+        return 1;
+    }
+    if (i == 0 || LTYPE(v->cell[0]) != LVAL_SYM) {
+        return 0;
+    }
+    lval* f = lval_fold_global(v->cell[0]->sym);
+    if (f == NULL || LTYPE(f) != LVAL_FUN || !LVAL_IS_BUILTIN(f)) {
+        return 0;
+    }
+    lbuiltin b = f->builtin;
+    return (i == 1 && (b == builtin_let || b == builtin_eval ||
+                b == builtin_try || b == builtin_while)) ||
+        (i == 2 && b == builtin_while) ||
+        (i == 3 && (b == builtin_dotimes || b == builtin_for_each));
+}
+
+/* a copy of the expression v as type */
+lval* lval_recast(lval* v, int type) {
+    lval* x = lval_new(type);
+    for (int i=0; i < v->count; i++) {
+        lval_add(x, v->cell[i]);
+    }
+    return x;
+}
+
+/* what a macro came back with, as code in an expression of type. the
+ * Q-Expression it makes is the code itself. */
+lval* lval_expansion(lval* r, int type) {
+    if (LTYPE(r) == LVAL_SEXPR || LTYPE(r) == LVAL_QEXPR) {
+        return lval_recast(r, type);
+    }
+    /* a body or a branch has to stay a Q-Expression */
+    return type == LVAL_QEXPR ? lval_add(lval_qexpr(), r) : r;
+}
+
+/* a kept expansion is good while no macro it used has been bound again
+ * and no new one has been made. both counts only go up. */
+long lval_expand_epoch(void) {
+    return folds.epoch + folds.macros;
+}
+
+/* the code v with its macro calls expanded, v itself included. v is left
+ * alone, as lval_fold does, apart from keeping the expansion on it. */
+lval* lval_expand(lval* v) {
+    if (LTYPE(v) != LVAL_SEXPR && LTYPE(v) != LVAL_QEXPR) {
+        return v;
+    }
+    if ((v->flags & LFLAG_EXPANDED) &&
+            LNUM(v->expansion->cell[1]) == lval_expand_epoch()) {
+        return v->expansion->cell[0];
+    }
+
+    lval* y = v;
+    lval* m = lval_macro(v);
+    if (m) {
+        y = lval_expand_call(m, v);
+    } else {
+        /* copies are rooted in v's place while macros run */
+        gc_push(v);
+        int root = gc.nroots-1;
+        for (int i=0; i < v->count; i++) {
+            if (!lval_expand_code(v, i)) {
+                continue;
+            }
+            lval* x = lval_expand(v->cell[i]);
+            if (x != v->cell[i]) {
+                if (y == v) {
+                    y = lval_recast(v, v->type);
+                    gc.roots[root] = y;
+                }
+                y->cell[i] = x;
+            }
+        }
+        gc_pop(1);
+    }
+
+    if (y != v) {
+        lval_expand_keep(v, y);
+    } else if (v->flags & LFLAG_EXPANDED) {
+        lval_uncompile(v);
+    }
+    return y;
+}
+
+/* what the macro m makes of the call v, expanded in turn. the args go in
+ * as they are, unevaluated. */
+lval* lval_expand_call(lval* m, lval* v) {
+    lval* r = eval_enter();
+    if (r) {
+        return r;
+    }
+    /* binding the name again bumps folds.epoch, see lsym_rebind */
+    LSYM(v->cell[0]->sym)->folded = 1;
+
+    r = lval_lambda_call(global_env, m, lval_slice(v, 1));
+    r = lval_expansion(r, v->type);
+    gc_push(r);
+    r = lval_expand(r);
+    gc_pop(1);
+
+    ev.nesting--;
+    return r;
+}
+
+/* keeps y as the expansion of v, as {y epoch}, in the slot compiled code
+ * would go in. v's cells are left alone, they can be shared with slices.
+ * a slice's slot is its owner, and code that's been compiled could be
+ * running, so neither keeps one. */
+void lval_expand_keep(lval* v, lval* y) {
+    if (LVAL_IS_SLICE(v) || (v->code && !(v->flags & LFLAG_EXPANDED))) {
+        return;
+    }
+    lval* k = lval_sexpr();
+    lval_add(k, y);
+    lval_add(k, lval_num(lval_expand_epoch()));
+    v->expansion = k;
+    v->flags |= LFLAG_EXPANDED;
+}
+
+/* the top-level form v, expanded and ready to run. a Q-Expression up
+ * there is just data. */
+lval* lval_expand_form(lval* v) {
+    if (LTYPE(v) != LVAL_SEXPR) {
+        return v;
+    }
+    lval* x = lval_expand(v);
+    if (x != v) {
+        lval_resolve(x, NULL);
+    }
+    return x;
+}
+
+/* a macro applied at run time, to code built on the fly say, instead of
+ * expanded. its args a have been evaluated, which leaves Q-Expressions
+ * and literals as they were, and what it makes of them runs in e. */
+lval* lval_macro_call(lenv* e, lval* m, lval* a) {
+    gc_push(a);
+    lval* x = lval_lambda_call(e, m, a);
+    gc_pop(1);
+    if (LTYPE(x) == LVAL_ERR) {
+        return x;
+    }
+
+    x = lval_expansion(x, LVAL_SEXPR);
+    gc_push(x);
+    x = lval_expand(x);
+    gc.roots[gc.nroots-1] = x;
+    lval* r = lval_eval(e, x);
+    gc_pop(1);
+    return r;
+}
+
+lval* lval_eval(lenv* e, lval* v) {
+    if (LTYPE(v) == LVAL_SYM) {
+        return lenv_lookup(e, v);
+    }
+    if (LTYPE(v) == LVAL_SEXPR) {
+        return lval_eval_sexpr(e, v);
+    }
+    return v;
+}
+
+/* works out once, when f is built, how calls to it bind their args (see
+ * lval_bind): its arity and whether a '& rest' follows. simple lambdas,
+ * with no '&' and distinct formals, can skip lenv_put altogether, see
+ * lval_frame. the frames f makes will bind its formals, so they count as
+ * locals from here on. */
+void lval_arity(lval* f) {
+    lval* formals = f->formals;
+    int distinct = 1;
+    f->arity = formals->count;
+    for (int i=0, slot=0; i < formals->count; i++) {
+        char* sym = formals->cell[i]->sym;
+        LSYM(sym)->locals = 1;
+        lsym_rebind(LSYM(sym));
+        if (sym == sym_amp) {
+            f->arity = MIN(f->arity, i);
+        } else if (lval_formal_slot(formals, sym) != slot++) {
+            distinct = 0;
+        }
+    }
+
+    if (f->arity == formals->count) {
+        if (distinct && formals->count <= LENV_HASH_THRESHOLD) {
+            f->flags |= LFLAG_SIMPLE;
+        }
+    } else if (f->arity == formals->count-2) {
+        f->flags |= LFLAG_VARIADIC;
+    } else {
+        f->flags |= LFLAG_BADFORMALS;
+    }
+}
+
+/* a frame for calling the simple lambda f with exactly its formals' worth
+ * of args, straight from wherever they are */
+lenv* lval_frame(lenv* e, lval* f, lval** args) {
+    lenv* env = lenv_new();
+    int n = f->formals->count;
+    lenv_reserve(env, n);
+    for (int i=0; i < n; i++) {
+        env->syms[i] = f->formals->cell[i]->sym;
+        env->vals[i] = args[i];
+        LSYM(env->syms[i])->frames++;
+    }
+    env->count = n;
+    env->parent = e;
+    return env;
+}
+
+/* calls the builtin f on a. the ones memo makes carry their cache along,
+ * see memo_call */
+lval* lval_builtin_call(lenv* e, lval* f, lval* a) {
+    if (f->memo) {
+        return memo_call(e, f, a);
+    }
+    return f->builtin(e, a);
+}
+
+/* calls f on the values a from C, for builtins that take a function */
+lval* lval_call(lenv* e, lval* f, lval* a) {
+    if (LVAL_IS_BUILTIN(f)) {
+        return lval_builtin_call(e, f, a);
+    }
+    if (f->flags & LFLAG_MACRO) {
+        return lval_macro_call(e, f, a);
+    }
+    return lval_lambda_call(e, f, a);
+}
+
+lval* lval_lambda_call(lenv* e, lval* f, lval* a) {
+    lval* r = jit_call(f, a->cell, a->count);
+    if (r) {
+        return r;
+    }
+    lenv* env;
+    if ((r = lval_bind(e, f, a, &env))) {
+        return r;
+    }
+    return lval_eval_sexpr(env, lval_body(f));
+}
+
+/* binds a into a fresh frame for the lambda f, starting from whatever an
+ * earlier partial application already bound. f itself is never modified.
+ * returns NULL with *env ready to run f's body in, or else an error or the
+ * partially applied function. */
+lval* lval_bind(lenv* e, lval* f, lval* a, lenv** env_out) {
+    lval* formals = f->formals;
+    int given = a->count;
+
+    if ((f->flags & LFLAG_SIMPLE) && given == formals->count) {
+        *env_out = lval_frame(e, f, a->cell);
+        return NULL;
+    }
+
+    if (given < f->arity) {
+        return lval_partial(f, a);
+    }
+    if ((f->flags & LFLAG_BADFORMALS) && given > f->arity) {
+        return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
+    }
+    if (f->flags & LFLAG_BADFORMALS) {
+        return lval_err("Function formal invalid. Symbol '&' not followed by single symbol.");
+    }
+    if (given > f->arity && !(f->flags & LFLAG_VARIADIC)) {
+        return lval_err("Function passed too many arguments. \
+                    Got %i, Expected %i", given, formals->count);
+    }
+
+    lenv* env = lenv_copy(f->env, formals->count);
+    for (int i=0; i < f->arity; i++) {
+        lenv_put(env, formals->cell[i], lval_pop(a, 0));
+    }
+    /* whatever's left, maybe nothing, is the rest */
+    if (f->flags & LFLAG_VARIADIC) {
+        a->type = LVAL_QEXPR;
+        lenv_put(env, formals->cell[f->arity+1], a);
+    }
+
+    env->parent = e;
+    *env_out = env;
+    return NULL;
+}
+
+/* f with its first few formals bound to a. the result shares f's body
+ * and the rest of its formals, only the new bindings are made. */
+lval* lval_partial(lval* f, lval* a) {
+    lenv* env = lenv_copy(f->env, a->count);
+    for (int i=0; i < a->count; i++) {
+        lenv_put(env, f->formals->cell[i], a->cell[i]);
+    }
+
+    lval* g = lval_new(LVAL_FUN);
+    g->env = env;
+    g->formals = lval_slice(f->formals, a->count);
+    g->body = f->body;
+    g->arity = f->arity - a->count;
+    g->flags |= f->flags & (LFLAG_VARIADIC | LFLAG_BADFORMALS);
+    return g;
+}
+
+/* whether v looks like a do whose last form OP_DO can run in its place */
+int vm_do_form(lval* v) {
+    return v->count >= 2 && LTYPE(v->cell[0]) == LVAL_SYM &&
+        v->cell[0]->sym == sym_do &&
+        LTYPE(v->cell[v->count-1]) == LVAL_SEXPR;
+}
+
+/* number of instructions v compiles to, not counting OP_RETURN */
+int vm_size(lval* v) {
+    int n = lval_lazy_form(v) ? 2 : 1;
+    int code = vm_do_form(v) ? v->count-1 : v->count;
+    for (int i=0; i < v->count; i++) {
+        int inline_sexpr = i < code && LTYPE(v->cell[i]) == LVAL_SEXPR;
+        n += inline_sexpr ? vm_size(v->cell[i]) : 1;
+    }
+    return n;
+}
+
+vm_ins* vm_emit(vm_ins* pc, lval* v) {
+    int code = vm_do_form(v) ? v->count-1 : v->count;
+    vm_ins* lazy = NULL;
+    for (int i=0; i < v->count; i++) {
+        lval* x = v->cell[i];
+        if (i == 2 && lval_lazy_form(v)) {
+            lazy = pc++;
+        }
+        switch (i < code ? LTYPE(x) : LVAL_QEXPR) {
+            case LVAL_SYM:
+                *pc++ = (vm_ins){ OP_LOOKUP, 0, x };
+                break;
+            case LVAL_SEXPR:
+                pc = vm_emit(pc, x);
+                break;
+            default:
+                *pc++ = (vm_ins){ OP_CONST, 0, x };
+                break;
+        }
+    }
+    vm_op_t op = code < v->count ? OP_DO : OP_APPLY;
+    *pc++ = (vm_ins){ op, v->count, NULL };
+    if (lazy) {
+        *lazy = (vm_ins){ OP_LAZY, pc - (lazy+1), NULL };
+    }
+    return pc;
+}
+
+/* compiled on first run and kept on v, which can't change after that.
+ * a slice gets its own cells first so it has somewhere to keep it. */
+vm_ins* vm_code(lval* v) {
+    if (LVAL_IS_SLICE(v)) {
+        lval_resize(v, v->count);
+    }
+    if (v->flags & LFLAG_EXPANDED) {
+        lval_uncompile(v);
+    }
+    if (v->code == NULL) {
+        v->code = malloc(sizeof(vm_ins) * (vm_size(v) + 1));
+        vm_ins* pc = vm_emit(v->code, v);
+        *pc = (vm_ins){ OP_RETURN, 0, NULL };
+    }
+    return v->code;
+}
+
+/* only code that runs more than once is worth compiling. plenty of it is
+ * built on the fly and run once (unpack, select), so the first run of
+ * anything goes through the tree walker instead. */
+int vm_warm(lval* v) {
+    if (v->flags & LFLAG_SEEN) {
+        return 1;
+    }
+    v->flags |= LFLAG_SEEN;
+    return 0;
+}
+
+/* run v in e. v stays rooted underneath the frame while its code runs */
+void vm_push_frame(lenv* e, lval* v, int own) {
+    if (vm.count == vm.cap) {
+        vm.cap = MAX(16, vm.cap * 2);
+        vm.frames = realloc(vm.frames, sizeof(vm_frame) * vm.cap);
+    }
+    gc_push_env(e);
+    gc_push(v);
+    vm.frames[vm.count++] = (vm_frame){ vm_code(v), e, gc.nroots, own };
+}
+
+/* run v in e in place of the current frame, for a call in tail position.
+ * whatever the old frame had on the stack is dropped with it. */
+void vm_replace_frame(lenv* e, lval* v, int own) {
+    vm_frame* fr = &vm.frames[vm.count-1];
+    gc.nroots = fr->base - 1;
+    gc.env_roots[gc.nenv_roots-1] = e;
+    gc_push(v);
+    *fr = (vm_frame){ vm_code(v), e, gc.nroots, own };
+}
+
+/* where vm_apply goes on to run v in e. NULL, or an error if that
+ * would take it past max-depth */
+lval* vm_enter(lenv* e, lval* v, int n, int own, int tail) {
+    if (tail) {
+        vm_replace_frame(e, v, own);
+        return NULL;
+    }
+    lval* err = eval_too_deep();
+    if (err) {
+        return err;
+    }
+    gc_pop(n);
+    vm_push_frame(e, v, own);
+    return NULL;
+}
+
+/* the top n values on the stack as a fresh args list */
+lval* vm_args(int n) {
+    lval* a = lval_sexpr();
+    lval_reserve(a, n);
+    memcpy(a->cell, &gc.roots[gc.nroots-n], sizeof(lval*) * n);
+    a->count = n;
+    return a;
+}
+
+/* applies the top n values on the stack, the way eval_apply does.
+ * returns the result, or NULL if it pushed a frame that will produce it:
+ * lambda bodies and the branches of if and eval run in the same loop
+ * instead of recursing through C. a tail call (the frame returns straight
+ * after) replaces the running frame instead of pushing, see
+ * lval_eval_tree. */
+lval* vm_apply(lenv* e, int n, int tail) {
+    vm_frame* fr = &vm.frames[vm.count-1];
+    lval** v = &gc.roots[gc.nroots-n];
+
+    for (int i=0; i < n; i++) {
+        if (LTYPE(v[i]) == LVAL_ERR) {
+            return v[i];
+        }
+    }
+
+    if (n == 0) {
+        return lval_sexpr();
+    }
+
+    /* a lone builtin is called with no arguments below */
+    lval* f = v[0];
+    if (n == 1 && !(LTYPE(f) == LVAL_FUN && LVAL_IS_BUILTIN(f))) {
+        return lval_eval(e, f);
+    }
+
+    if (LTYPE(f) != LVAL_FUN) {
+        return lval_err(
+                "S-expression starts with incorrect type. Got %s, Expected %s.",
+                ltype_name(LTYPE(f)), ltype_name(LVAL_FUN));
+    }
+
+    if (LVAL_IS_BUILTIN(f)) {
+        lenv* env = e;
+        lval* code = lval_tail_code(f, &v[1], n-1, &env);
+        if (code) {
+            if (!vm_warm(code) && !eval_nested_deep()) {
+                return lval_eval_tree(env, code);
+            }
+            return vm_enter(env, code, n, env != e || (tail && fr->own), tail);
+        }
+
+        lval* a = vm_args(n-1);
+        gc_push(a);
+        lval* r = lval_builtin_call(e, f, a);
+        gc_pop(1);
+        return r;
+    }
+    if (f->flags & LFLAG_MACRO) {
+        return lval_macro_call(e, f, vm_args(n-1));
+    }
+
+    lval* r = jit_call(f, &v[1], n-1);
+    if (r) {
+        return r;
+    }
+
+    lenv* env;
+    if (tail && fr->own && lval_frame_reuse(e, f, &v[1], n-1)) {
+        env = e;
+    } else if ((f->flags & LFLAG_SIMPLE) && n-1 == f->formals->count) {
+        env = lval_frame(e, f, &v[1]);
+    } else if ((r = lval_bind(e, f, vm_args(n-1), &env))) {
+        return r;
+    }
+    lval* body = lval_body(f);
+    if (!vm_warm(body) && !eval_nested_deep()) {
+        return lval_eval_tree(env, body);
+    }
+    return vm_enter(env, body, n, 1, tail);
+}
+
+/* a do with its last form still unevaluated on top of the stack. if do
+ * still means do, the last form runs in place of the call, in tail
+ * position if the do is. otherwise it's evaluated and the call goes ahead
+ * as normal. */
+lval* vm_do(lenv* e, int n, int tail) {
+    vm_frame* fr = &vm.frames[vm.count-1];
+    lval* last = gc.roots[gc.nroots-1];
+
+    if (lval_do_last(&gc.roots[gc.nroots-n], n-1)) {
+        if (!vm_warm(last) && !eval_nested_deep()) {
+            return lval_eval_tree(e, last);
+        }
+        return vm_enter(e, last, n, tail && fr->own, tail);
+    }
+
+    lval* x = lval_eval_sexpr(e, last);
+    gc.roots[gc.nroots-1] = x;
+    return vm_apply(e, n, tail);
+}
+
+/* drops every frame above bottom, and whatever they had on the stack,
+ * for an error that's what they'd all have returned, see
+ * lval_eval_tree */
+lval* vm_unwind(int bottom, lval* err) {
+    gc.nroots = vm.frames[bottom].base - 1;
+    gc_pop_env(vm.count - bottom);
+    vm.count = bottom;
+    ev.nesting--;
+    return err;
+}
+
+/* evaluates v as code in e, like lval_eval_sexpr. builtins that evaluate
+ * code themselves come back in here, so the loop stops once the frame it
+ * started with returns, or an error turns up. */
+lval* vm_run(lenv* e, lval* v) {
+    lval* err = eval_enter();
+    if (err) {
+        return err;
+    }
+    if ((err = eval_too_deep())) {
+        ev.nesting--;
+        return err;
+    }
+
+    int bottom = vm.count;
+    vm_push_frame(e, v, 0);
+
+    while (1) {
+        vm_frame* fr = &vm.frames[vm.count-1];
+        vm_ins* ins = fr->pc++;
+        lval* r;
+
+        switch (ins->op) {
+            case OP_CONST:
+                gc_push(ins->x);
+                break;
+            case OP_LOOKUP:
+                r = lenv_lookup(fr->env, ins->x);
+                if (LTYPE(r) == LVAL_ERR) {
+                    return vm_unwind(bottom, r);
+                }
+                gc_push(r);
+                break;
+            case OP_APPLY:
+                /* safe point: the stack, frames and code are all roots */
+                gc_maybe_collect();
+                r = vm_apply(fr->env, ins->n, fr->pc->op == OP_RETURN);
+                if (r && LTYPE(r) == LVAL_ERR) {
+                    return vm_unwind(bottom, r);
+                }
+                if (r) {
+                    gc_pop(ins->n);
+                    gc_push(r);
+                }
+                break;
+            case OP_DO:
+                gc_maybe_collect();
+                r = vm_do(fr->env, ins->n, fr->pc->op == OP_RETURN);
+                if (r && LTYPE(r) == LVAL_ERR) {
+                    return vm_unwind(bottom, r);
+                }
+                if (r) {
+                    gc_pop(ins->n);
+                    gc_push(r);
+                }
+                break;
+            case OP_LAZY:
+                r = lval_lazy(&gc.roots[gc.nroots-2]);
+                if (r) {
+                    gc_pop(2);
+                    gc_push(r);
+                    fr->pc += ins->n;
+                }
+                break;
+            case OP_RETURN:
+                r = gc.roots[gc.nroots-1];
+                gc.nroots = fr->base - 1;
+                gc_pop_env(1);
+                vm.count--;
+                if (vm.count == bottom) {
+                    ev.nesting--;
+                    return r;
+                }
+                gc_push(r);
+                break;
+        }
+    }
+}
+
+/* the closure tier, behind --closures. lambda bodies are compiled when
+ * they're built into a tree of nodes, one per cell or expression, that
+ * each know what they are: a constant, a local slot, a global, an if with
+ * compiled branches, a call. running the body is then just calling down
+ * the tree, with no looking at types on the way. anything that isn't a
+ * compiled body (top level code, eval of a built list) still goes
+ * through lval_eval_sexpr. */
+cnode* cnode_new(cnode_fn run, lval* x, int count) {
+    cnode* n = malloc(sizeof(cnode));
+    n->run = run;
+    n->x = x;
+    n->slot = -1;
+    n->count = count;
+    n->cells = count ? malloc(sizeof(cnode*) * count) : NULL;
+    return n;
+}
+
+void cnode_del(cnode* n) {
+    for (int i=0; i < n->count; i++) {
+        cnode_del(n->cells[i]);
+    }
+    free(n->cells);
+    free(n);
+}
+
+/* compiles body, which has been through lval_resolve, and keeps the tree
+ * on it. a body shared between lambdas is only compiled once. */
+void cnode_compile(lval* body) {
+    if (body->flags & LFLAG_CNODE) {
+        return;
+    }
+    if (LVAL_IS_SLICE(body)) {
+        lval_resize(body, body->count);
+    }
+    lval_uncompile(body);
+    body->node = cnode_expr(body);
+    body->flags |= LFLAG_CNODE;
+}
+
+/* a node for the cell x */
+cnode* cnode_cell(lval* x) {
+    switch (LTYPE(x)) {
+        case LVAL_SYM:
+            if (x->slot >= 0) {
+                cnode* n = cnode_new(cnode_local, x, 0);
+                n->slot = x->slot;
+                return n;
+            }
+            return cnode_new(cnode_lookup, x, 0);
+        case LVAL_SEXPR:
+            return cnode_expr(x);
+        default:
+            return cnode_new(cnode_const, x, 0);
+    }
+}
+
+/* a node that evaluates the cells of v as code */
+cnode* cnode_expr(lval* v) {
+    cnode* n;
+    if (v->count == 4 && LTYPE(v->cell[0]) == LVAL_SYM &&
+            v->cell[0]->sym == sym_if &&
+            LTYPE(v->cell[2]) == LVAL_QEXPR &&
+            LTYPE(v->cell[3]) == LVAL_QEXPR) {
+        n = cnode_new(cnode_if, v, 4);
+        n->cells[0] = cnode_cell(v->cell[0]);
+        n->cells[1] = cnode_cell(v->cell[1]);
+        n->cells[2] = cnode_expr(v->cell[2]);
+        n->cells[3] = cnode_expr(v->cell[3]);
+        return n;
+    }
+
+    cnode_fn run = vm_do_form(v) ? cnode_do :
+        lval_lazy_form(v) ? cnode_lazy : cnode_call;
+    n = cnode_new(run, v, v->count);
+    for (int i=0; i < v->count; i++) {
+        n->cells[i] = cnode_cell(v->cell[i]);
+    }
+    return n;
+}
+
+lval* cnode_const(lenv* e, cnode* n, cnode_tail* t) {
+    return n->x;
+}
+
+/* a formal of the lambda, in its slot unless something odd happened */
+lval* cnode_local(lenv* e, cnode* n, cnode_tail* t) {
+    if (n->slot < e->count && e->syms[n->slot] == n->x->sym) {
+        return e->vals[n->slot];
+    }
+    return lenv_get(e, n->x);
+}
+
+lval* cnode_lookup(lenv* e, cnode* n, cnode_tail* t) {
+    return lenv_lookup(e, n->x);
+}
+
+/* evaluates cells from up to end onto the stack. NULL, or the first
+ * error with the stack as it was, see lval_eval_tree. */
+lval* cnode_args(lenv* e, cnode* n, int from, int end) {
+    for (int i=from; i < end; i++) {
+        cnode* c = n->cells[i];
+        lval* x = c->run(e, c, NULL);
+        if (LTYPE(x) == LVAL_ERR) {
+            gc_pop(i - from);
+            return x;
+        }
+        gc_push(x);
+    }
+    return NULL;
+}
+
+/* evaluates the cells onto the stack and applies them */
+lval* cnode_call(lenv* e, cnode* n, cnode_tail* t) {
+    lval* r = cnode_args(e, n, 0, n->count);
+    if (r) {
+        return r;
+    }
+    r = cnode_apply(e, n->count, t);
+    gc_pop(n->count);
+    return r;
+}
+
+/* (if c {then} {else}): runs the branch's compiled code directly, as long
+ * as if still means if and c is a number. otherwise it's just a call. */
+lval* cnode_if(lenv* e, cnode* n, cnode_tail* t) {
+    lval* f = n->cells[0]->run(e, n->cells[0], NULL);
+    if (LTYPE(f) == LVAL_ERR) {
+        return f;
+    }
+    gc_push(f);
+    lval* c = n->cells[1]->run(e, n->cells[1], NULL);
+    if (LTYPE(c) == LVAL_ERR) {
+        gc_pop(1);
+        return c;
+    }
+    if (LTYPE(f) == LVAL_FUN && LVAL_IS_BUILTIN(f) &&
+            f->builtin == builtin_if && LTYPE(c) == LVAL_NUM) {
+        gc_pop(1);
+        cnode* branch = n->cells[LNUM(c) ? 2 : 3];
+        if (t) {
+            t->node = branch;
+            return NULL;
+        }
+        return cnode_exec(e, branch, n->x, 0);
+    }
+
+    gc_push(c);
+    gc_push(n->x->cell[2]);
+    gc_push(n->x->cell[3]);
+    lval* r = cnode_apply(e, 4, t);
+    gc_pop(4);
+    return r;
+}
+
+/* (do ... last): runs the forms in order, then last in place of the do,
+ * in tail position if the do is. as long as do still means do, that is,
+ * otherwise it's just a call. */
+lval* cnode_do(lenv* e, cnode* n, cnode_tail* t) {
+    lval* r = cnode_args(e, n, 0, n->count-1);
+    if (r) {
+        return r;
+    }
+    lval** v = &gc.roots[gc.nroots-(n->count-1)];
+    if (lval_do_last(v, n->count-1)) {
+        gc_pop(n->count-1);
+        cnode* last = n->cells[n->count-1];
+        if (t) {
+            t->node = last;
+            return NULL;
+        }
+        return cnode_exec(e, last, n->x, 0);
+    }
+
+    if ((r = cnode_args(e, n, n->count-1, n->count))) {
+        gc_pop(n->count-1);
+        return r;
+    }
+    r = cnode_apply(e, n->count, t);
+    gc_pop(n->count);
+    return r;
+}
+
+/* (&& x y) or (|| x y): y only runs if x doesn't settle it, see
+ * lval_lazy */
+lval* cnode_lazy(lenv* e, cnode* n, cnode_tail* t) {
+    lval* r = cnode_args(e, n, 0, 2);
+    if (r) {
+        return r;
+    }
+    if ((r = lval_lazy(&gc.roots[gc.nroots-2]))) {
+        gc_pop(2);
+        return r;
+    }
+    if ((r = cnode_args(e, n, 2, 3))) {
+        gc_pop(2);
+        return r;
+    }
+    r = cnode_apply(e, 3, t);
+    gc_pop(3);
+    return r;
+}
+
+/* applies the top n values on the stack, the way eval_apply does. in
+ * tail position a compiled lambda body is left in t to run next. */
+lval* cnode_apply(lenv* e, int n, cnode_tail* t) {
+    lval** v = &gc.roots[gc.nroots-n];
+
+    for (int i=0; i < n; i++) {
+        if (LTYPE(v[i]) == LVAL_ERR) {
+            return v[i];
+        }
+    }
+
+    if (n == 0) {
+        return lval_sexpr();
+    }
+
+    /* a lone builtin is called with no arguments below */
+    lval* f = v[0];
+    if (n == 1 && !(LTYPE(f) == LVAL_FUN && LVAL_IS_BUILTIN(f))) {
+        return lval_eval(e, f);
+    }
+
+    if (LTYPE(f) != LVAL_FUN) {
+        return lval_err(
+                "S-expression starts with incorrect type. Got %s, Expected %s.",
+                ltype_name(LTYPE(f)), ltype_name(LVAL_FUN));
+    }
+
+    /* safe point: the values are all on the stack */
+    gc_maybe_collect();
+
+    if (LVAL_IS_BUILTIN(f)) {
+        lval* a = vm_args(n-1);
+        gc_push(a);
+        lval* r = lval_builtin_call(e, f, a);
+        gc_pop(1);
+        return r;
+    }
+    if (f->flags & LFLAG_MACRO) {
+        return lval_macro_call(e, f, vm_args(n-1));
+    }
+
+    lval* r = jit_call(f, &v[1], n-1);
+    if (r) {
+        return r;
+    }
+
+    lenv* env;
+    if (t && t->own && lval_frame_reuse(e, f, &v[1], n-1)) {
+        env = e;
+    } else if ((f->flags & LFLAG_SIMPLE) && n-1 == f->formals->count) {
+        env = lval_frame(e, f, &v[1]);
+    } else if ((r = lval_bind(e, f, vm_args(n-1), &env))) {
+        return r;
+    }
+
+    /* bodies built before --closures took effect, ones back on their
+     * unfolded code, or a stack that's got too deep for C, go through the
+     * tree walker */
+    lval* body = lval_body(f);
+    if (!(body->flags & LFLAG_CNODE) || eval_nested_deep()) {
+        return lval_eval_tree(env, body);
+    }
+    if (t) {
+        *t = (cnode_tail){ env, body->node, body, 1 };
+        return NULL;
+    }
+    return cnode_exec(env, body->node, body, 1);
+}
+
+/* runs node, part of body, in e. calls in tail position come back here
+ * to run rather than nesting, so tail recursion stays flat. */
+lval* cnode_exec(lenv* e, cnode* node, lval* body, int own) {
+    lval* r = eval_too_deep();
+    if (r == NULL) {
+        r = eval_enter();
+    }
+    if (r) {
+        return r;
+    }
+
+    gc_push_env(e);
+    gc_push(body);
+    int eroot = gc.nenv_roots-1;
+    int broot = gc.nroots-1;
+
+    cnode_tail t = { e, node, body, own };
+    while ((r = t.node->run(t.env, t.node, &t)) == NULL) {
+        gc.env_roots[eroot] = t.env;
+        gc.roots[broot] = t.body;
+    }
+
+    gc_pop(1);
+    gc_pop_env(1);
+    ev.nesting--;
+    return r;
+}
+
+/* a baseline jit. lambdas that have been called JIT_HOT times get their
+ * body compiled to x86-64 by pasting together a fixed template for each
+ * form, if every form in it is one of:
+ *
+ *   a fixnum, a formal, or a global bound to a fixnum
+ *   + - * and the comparisons, done inline on tagged fixnums
+ *   the other builtins lval_fold_pure knows, called back through C
+ *   if, with both branches literal Q-Expressions
+ *   the lambda calling itself, a jump when it's in tail position
+ *
+ * none of those have side effects, which keeps it simple: anything the
+ * native code isn't sure of, an arg that's not a fixnum, overflow, a
+ * builtin that doesn't come back with a fixnum, going too deep, it
+ * bails out of the whole call and the evaluators run it from the top.
+ * globals are checked when it's compiled, and marked folded so binding
+ * one again bumps folds.epoch and sends the lambda back to be counted
+ * and compiled afresh. */
+
+#define JIT_EMIT(a, s) strbuf_add(&(a)->code, s, sizeof(s)-1)
+
+void jit_u32(jit_asm* a, uint32_t x) {
+    strbuf_add(&a->code, (char*)&x, 4);
+}
+
+void jit_u64(jit_asm* a, uint64_t x) {
+    strbuf_add(&a->code, (char*)&x, 8);
+}
+
+/* a jump or call to the label at, which has already been emitted */
+void jit_jump(jit_asm* a, char* op, int n, size_t at) {
+    strbuf_add(&a->code, op, n);
+    jit_u32(a, (uint32_t)(at - (a->code.len + 4)));
+}
+
+/* a jump to a label that's still to come. returns where to patch it, see
+ * jit_land */
+size_t jit_jump_ahead(jit_asm* a, char* op, int n) {
+    strbuf_add(&a->code, op, n);
+    jit_u32(a, 0);
+    return a->code.len - 4;
+}
+
+/* points the jump at patch to here */
+void jit_land(jit_asm* a, size_t patch) {
+    uint32_t rel = (uint32_t)(a->code.len - (patch + 4));
+    memcpy(a->code.s + patch, &rel, 4);
+}
+
+/* what sym is for code compiled into f: the index of a formal, or -1 with
+ * *g its global value. 0 if neither can be relied on. */
+int jit_sym(jit_asm* a, char* sym, int* formal, lval** g) {
+    *formal = lval_formal_slot(a->f->formals, sym);
+    if (*formal >= 0) {
+        return 1;
+    }
+    *g = lval_fold_global(sym);
+    if (*g == NULL) {
+        return 0;
+    }
+    LSYM(sym)->folded = 1;
+    return 1;
+}
+
+/* emits code leaving the value of v in rax. it's always a fixnum by the
+ * time it gets there. in tail position it returns it instead. */
+int jit_expr(jit_asm* a, lval* v, int tail) {
+    switch (LTYPE(v)) {
+        case LVAL_NUM:
+            if (!LVAL_IS_INT(v)) {
+                return 0;
+            }
+            JIT_EMIT(a, "\x48\xb8");                /* mov rax, v */
+            jit_u64(a, (uint64_t)v);
+            break;
+        case LVAL_SYM: {
+            int formal;
+            lval* g;
+            if (!jit_sym(a, v->sym, &formal, &g)) {
+                return 0;
+            }
+            if (formal < 0) {
+                return LVAL_IS_INT(g) && jit_expr(a, g, tail);
+            }
+            JIT_EMIT(a, "\x48\x8b\x85");            /* mov rax, [rbp+arg] */
+            jit_u32(a, 16 + 8 * formal);
+            JIT_EMIT(a, "\xa8\x01");                /* test al, 1 */
+            jit_jump(a, "\x0f\x84", 2, a->bail);    /* jz bail */
+            break;
+        }
+        case LVAL_SEXPR:
+            return jit_code(a, v, tail);
+        default:
+            return 0;
+    }
+    if (tail) {
+        JIT_EMIT(a, "\xc9\xc3");                    /* leave; ret */
+    }
+    return 1;
+}
+
+/* v run as code, the way a body or a branch of an if is */
+int jit_code(jit_asm* a, lval* v, int tail) {
+    if (v->count == 1 && LTYPE(v->cell[0]) != LVAL_QEXPR) {
+        return jit_expr(a, v->cell[0], tail);
+    }
+    if (v->count < 2 || LTYPE(v->cell[0]) != LVAL_SYM) {
+        return 0;
+    }
+
+    int formal;
+    lval* g;
+    if (!jit_sym(a, v->cell[0]->sym, &formal, &g) || formal >= 0 ||
+            LTYPE(g) != LVAL_FUN) {
+        return 0;
+    }
+    lval** args = v->cell + 1;
+    int n = v->count - 1;
+
+    if (g == a->f) {
+        return n == a->nargs && jit_self(a, args, tail);
+    }
+    if (!LVAL_IS_BUILTIN(g) || LVAL_IS_MEMO(g)) {
+        return 0;
+    }
+    if (g->builtin == builtin_if) {
+        return n == 3 && LTYPE(args[1]) == LVAL_QEXPR &&
+            LTYPE(args[2]) == LVAL_QEXPR && jit_if(a, args, tail);
+    }
+
+    int ok;
+    if (g->builtin == builtin_add || g->builtin == builtin_sub ||
+            g->builtin == builtin_mul) {
+        ok = jit_arith(a, g->builtin, args, n);
+    } else if (g->builtin == builtin_lt || g->builtin == builtin_gt ||
+            g->builtin == builtin_lte || g->builtin == builtin_gte ||
+            g->builtin == builtin_eq || g->builtin == builtin_neq) {
+        ok = n == 2 && jit_compare(a, g->builtin, args);
+    } else if (lval_fold_pure(g->builtin) && g->builtin != builtin_concat) {
+        ok = jit_callback(a, g->builtin, args, n);
+    } else {
+        ok = 0;
+    }
+    if (ok && tail) {
+        JIT_EMIT(a, "\xc9\xc3");                    /* leave; ret */
+    }
+    return ok;
+}
+
+/* the args two at a time, left in rax and rcx */
+int jit_pair(jit_asm* a, lval* y) {
+    JIT_EMIT(a, "\x50");                            /* push rax */
+    if (!jit_expr(a, y, 0)) {
+        return 0;
+    }
+    JIT_EMIT(a, "\x48\x89\xc1\x58");                /* mov rcx, rax; pop rax */
+    return 1;
+}
+
+/* tagged, a fixnum x is 2x+1, so for the sum take 1 off x first and for
+ * the product multiply 2x by y. overflow past 63 bits bails, and the
+ * evaluators box the result or switch to doubles. */
+int jit_arith(jit_asm* a, lbuiltin op, lval** args, int n) {
+    if (n == 0 || !jit_expr(a, args[0], 0)) {
+        return 0;
+    }
+    if (n == 1 && op == builtin_sub) {
+        JIT_EMIT(a, "\x48\x89\xc1");                /* mov rcx, rax */
+        JIT_EMIT(a, "\x48\xc7\xc0\x02\x00\x00\x00");    /* mov rax, 2 */
+        JIT_EMIT(a, "\x48\x29\xc8");                /* sub rax, rcx */
+        jit_jump(a, "\x0f\x80", 2, a->bail);        /* jo bail */
+        return 1;
+    }
+    for (int i=1; i < n; i++) {
+        if (!jit_pair(a, args[i])) {
+            return 0;
+        }
+        if (op == builtin_add) {
+            JIT_EMIT(a, "\x48\xff\xc8");            /* dec rax */
+            JIT_EMIT(a, "\x48\x01\xc8");            /* add rax, rcx */
+            jit_jump(a, "\x0f\x80", 2, a->bail);
+        } else if (op == builtin_sub) {
+            JIT_EMIT(a, "\x48\x29\xc8");            /* sub rax, rcx */
+            jit_jump(a, "\x0f\x80", 2, a->bail);
+            JIT_EMIT(a, "\x48\x83\xc8\x01");        /* or rax, 1 */
+        } else {
+            JIT_EMIT(a, "\x48\xff\xc8");            /* dec rax */
+            JIT_EMIT(a, "\x48\xd1\xf9");            /* sar rcx, 1 */
+            JIT_EMIT(a, "\x48\x0f\xaf\xc1");        /* imul rax, rcx */
+            jit_jump(a, "\x0f\x80", 2, a->bail);
+            JIT_EMIT(a, "\x48\x83\xc8\x01");        /* or rax, 1 */
+        }
+    }
+    return 1;
+}
+
+/* tagging keeps fixnums in order, so they compare as they are */
+int jit_compare(jit_asm* a, lbuiltin op, lval** args) {
+    if (!jit_expr(a, args[0], 0) || !jit_pair(a, args[1])) {
+        return 0;
+    }
+    JIT_EMIT(a, "\x48\x39\xc8");                    /* cmp rax, rcx */
+    if (op == builtin_lt) {
+        JIT_EMIT(a, "\x0f\x9c\xc0");                /* setl al */
+    } else if (op == builtin_gt) {
+        JIT_EMIT(a, "\x0f\x9f\xc0");                /* setg al */
+    } else if (op == builtin_lte) {
+        JIT_EMIT(a, "\x0f\x9e\xc0");                /* setle al */
+    } else if (op == builtin_gte) {
+        JIT_EMIT(a, "\x0f\x9d\xc0");                /* setge al */
+    } else if (op == builtin_eq) {
+        JIT_EMIT(a, "\x0f\x94\xc0");                /* sete al */
+    } else {
+        JIT_EMIT(a, "\x0f\x95\xc0");                /* setne al */
+    }
+    JIT_EMIT(a, "\x0f\xb6\xc0");                    /* movzx eax, al */
+    JIT_EMIT(a, "\x48\x8d\x44\x00\x01");            /* lea rax, [rax+rax+1] */
+    return 1;
+}
+
+int jit_if(jit_asm* a, lval** args, int tail) {
+    if (!jit_expr(a, args[0], 0)) {
+        return 0;
+    }
+    JIT_EMIT(a, "\x48\x83\xf8\x01");                /* cmp rax, 1 (zero) */
+    size_t no = jit_jump_ahead(a, "\x0f\x84", 2);   /* je no */
+    if (!jit_code(a, args[1], tail)) {
+        return 0;
+    }
+    size_t end = tail ? 0 : jit_jump_ahead(a, "\xe9", 1);   /* jmp end */
+    jit_land(a, no);
+    if (!jit_code(a, args[2], tail)) {
+        return 0;
+    }
+    if (!tail) {
+        jit_land(a, end);
+    }
+    return 1;
+}
+
+/* the args go on the stack last first, so the callee finds arg i at
+ * [rbp+16+8i]. a tail call copies them over its own and starts again. */
+int jit_self(jit_asm* a, lval** args, int tail) {
+    for (int i=a->nargs-1; i >= 0; i--) {
+        if (!jit_expr(a, args[i], 0)) {
+            return 0;
+        }
+        JIT_EMIT(a, "\x50");                        /* push rax */
+    }
+    if (tail) {
+        for (int i=0; i < a->nargs; i++) {
+            JIT_EMIT(a, "\x58\x48\x89\x85");        /* pop rax; mov [rbp+arg], rax */
+            jit_u32(a, 16 + 8 * i);
+        }
+        jit_jump(a, "\xe9", 1, a->top);             /* jmp top */
+        return 1;
+    }
+    JIT_EMIT(a, "\x49\xff\xcc");                    /* dec r12 */
+    jit_jump(a, "\x0f\x8e", 2, a->bail_deep);       /* jle bail_deep */
+    jit_jump(a, "\xe8", 1, a->body);                /* call body */
+    JIT_EMIT(a, "\x49\xff\xc4");                    /* inc r12 */
+    JIT_EMIT(a, "\x48\x81\xc4");                    /* add rsp, args */
+    jit_u32(a, 8 * a->nargs);
+    return 1;
+}
+
+/* calls jit_builtin with the args where they were pushed, on a stack
+ * lined up the way C expects */
+int jit_callback(jit_asm* a, lbuiltin op, lval** args, int n) {
+    if (n == 0) {
+        return 0;
+    }
+    for (int i=0; i < n; i++) {
+        if (!jit_expr(a, args[i], 0)) {
+            return 0;
+        }
+        JIT_EMIT(a, "\x50");                        /* push rax */
+    }
+    JIT_EMIT(a, "\x48\xbf");                        /* mov rdi, op */
+    jit_u64(a, (uint64_t)op);
+    JIT_EMIT(a, "\xbe");                            /* mov esi, n */
+    jit_u32(a, n);
+    JIT_EMIT(a, "\x48\x89\xe2");                    /* mov rdx, rsp */
+    JIT_EMIT(a, "\x48\x89\xe3");                    /* mov rbx, rsp */
+    JIT_EMIT(a, "\x48\x83\xe4\xf0");                /* and rsp, -16 */
+    JIT_EMIT(a, "\x48\xb8");                        /* mov rax, jit_builtin */
+    jit_u64(a, (uint64_t)jit_builtin);
+    JIT_EMIT(a, "\xff\xd0");                        /* call rax */
+    JIT_EMIT(a, "\x48\x89\xdc");                    /* mov rsp, rbx */
+    JIT_EMIT(a, "\x48\x81\xc4");                    /* add rsp, args */
+    jit_u32(a, 8 * n);
+    JIT_EMIT(a, "\x48\x85\xc0");                    /* test rax, rax */
+    jit_jump(a, "\x0f\x84", 2, a->bail);            /* jz bail */
+    return 1;
+}
+
+/* op on the n values native code pushed at sp, first arg deepest. NULL
+ * unless that comes to a fixnum. nothing it calls can reach a safe point,
+ * so the args needn't be rooted. */
+lval* jit_builtin(lbuiltin op, int n, lval** sp) {
+    lval* a = lval_sexpr();
+    for (int i=n-1; i >= 0; i--) {
+        lval_add(a, sp[i]);
+    }
+    lval* r = op(global_env, a);
+    return LVAL_IS_INT(r) ? r : NULL;
+}
+
+/* compiles f's body and files it under f, see jit_find. 0 if there's
+ * something in it native code can't do. */
+int jit_compile(lval* f) {
+#ifndef __x86_64__
+    return 0;
+#else
+    jit_asm a = { { NULL, 0, 0 }, f, f->formals->count, 0, 0, 0, 0 };
+
+    /* the entry point C calls. it pushes the args for the body, and keeps
+     * the stack pointer in r13 so a bail from any depth can drop
+     * straight back out. r12 is the budget. */
+    JIT_EMIT(&a, "\x55\x48\x89\xe5");               /* push rbp; mov rbp, rsp */
+    JIT_EMIT(&a, "\x53\x41\x54\x41\x55");           /* push rbx, r12, r13 */
+    JIT_EMIT(&a, "\x49\x89\xf4");                   /* mov r12, rsi */
+    JIT_EMIT(&a, "\x49\x89\xe5");                   /* mov r13, rsp */
+    for (int i=a.nargs-1; i >= 0; i--) {
+        JIT_EMIT(&a, "\xff\xb7");                   /* push [rdi+8i] */
+        jit_u32(&a, 8 * i);
+    }
+    size_t call = jit_jump_ahead(&a, "\xe8", 1);    /* call body */
+    size_t done = jit_jump_ahead(&a, "\xe9", 1);    /* jmp out */
+
+    a.bail_deep = a.code.len;
+    JIT_EMIT(&a, "\x48\xb8");                       /* mov rax, &jit.deep */
+    jit_u64(&a, (uint64_t)&jit.deep);
+    JIT_EMIT(&a, "\xc7\x00\x01\x00\x00\x00");       /* mov dword [rax], 1 */
+    a.bail = a.code.len;
+    JIT_EMIT(&a, "\x31\xc0");                       /* xor eax, eax */
+    jit_land(&a, done);
+    JIT_EMIT(&a, "\x4c\x89\xec");                   /* mov rsp, r13 */
+    JIT_EMIT(&a, "\x41\x5d\x41\x5c\x5b\x5d\xc3");   /* pop r13, r12, rbx, rbp; ret */
+
+    a.body = a.code.len;
+    jit_land(&a, call);
+    JIT_EMIT(&a, "\x55\x48\x89\xe5");               /* push rbp; mov rbp, rsp */
+    a.top = a.code.len;
+    if (!jit_code(&a, lval_body(f), 1)) {
+        free(a.code.s);
+        return 0;
+    }
+
+    void* mem = mmap(NULL, a.code.len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        free(a.code.s);
+        return 0;
+    }
+    memcpy(mem, a.code.s, a.code.len);
+    mprotect(mem, a.code.len, PROT_READ | PROT_EXEC);
+
+    jit_add(f, (jit_entry)mem, a.code.len);
+
+    free(a.code.s);
+    return 1;
+#endif
+}
+
+/* files run as f's native code. size is that of the mapping it's in, or
+ * 0 if it's not one of jit_compile's. */
+void jit_add(lval* f, jit_entry run, size_t size) {
+    jit_fn* fn = malloc(sizeof(jit_fn));
+    fn->f = f;
+    fn->run = run;
+    fn->size = size;
+    fn->epoch = folds.epoch;
+    fn->bails = 0;
+
+    jit_fn** bucket = &jit.fns[((uintptr_t)f >> 4) % JIT_BUCKETS];
+    fn->next = *bucket;
+    *bucket = fn;
+}
+
+jit_fn** jit_find(lval* f) {
+    jit_fn** fn = &jit.fns[((uintptr_t)f >> 4) % JIT_BUCKETS];
+    while ((*fn)->f != f) {
+        fn = &(*fn)->next;
+    }
+    return fn;
+}
+
+/* drops f's native code, when f is freed or its globals change */
+void jit_forget(lval* f) {
+    jit_fn** at = jit_find(f);
+    jit_fn* fn = *at;
+    *at = fn->next;
+    if (fn->size) {
+        munmap((void*)fn->run, fn->size);
+    }
+    free(fn);
+    f->hot = 0;
+}
+
+/* runs a call to the lambda f natively, compiling it if it's been called
+ * often enough. NULL if the evaluators should make the call as usual:
+ * there's no native code, or it bailed. native self calls count one each
+ * against max-depth, at most JIT_MAX_DEPTH of them before it bails. */
+lval* jit_call(lval* f, lval** args, int count) {
+    if (!jit.enabled || !(f->flags & LFLAG_SIMPLE) ||
+            count != f->formals->count) {
+        return NULL;
+    }
+    if (f->hot != JIT_NATIVE) {
+        if (f->hot == JIT_NEVER || ++f->hot < JIT_HOT) {
+            return NULL;
+        }
+        f->hot = jit_compile(f) ? JIT_NATIVE : JIT_NEVER;
+        if (f->hot == JIT_NEVER) {
+            return NULL;
+        }
+    }
+
+    jit_fn* fn = *jit_find(f);
+    if (fn->epoch != folds.epoch) {
+        jit_forget(f);
+        return NULL;
+    }
+
+    /* past a call that bailed for depth, the evaluators are running it
+     * again. trying again at every level on the way down would be
+     * quadratic. */
+    int depth = ev.count + vm.count + ev.nesting;
+    if (depth > jit.floor) {
+        return NULL;
+    }
+    jit.floor = INT_MAX;
+
+    jit.deep = 0;
+    lval* r = fn->run(args, MIN(JIT_MAX_DEPTH, ev.max_depth - depth));
+    if (r == NULL && jit.deep) {
+        jit.floor = depth;
+    } else if (r == NULL) {
+        /* a lambda that's mostly called on lists, say, bails after part
+         * of the work on nearly every call, and then the evaluators do
+         * all of it again. once it has bailed JIT_HOT times more than
+         * it's finished, it stays with them. */
+        if (++fn->bails >= JIT_HOT) {
+            jit_forget(f);
+            f->hot = JIT_NEVER;
+        }
+    } else if (fn->bails > 0) {
+        fn->bails--;
+    }
+    return r;
+}
+
+/* ahead of time compilation. lispy --compile foo.lispy -o foo.c reads the
+ * stdlib and foo.lispy and writes them out as a C program that builds
+ * the same forms with the lval constructors and hands them to aot_main,
+ * so it starts without reading or parsing anything. it includes
+ * lispy.c for the runtime, the way lispy_bench.c does.
+ *
+ * fun definitions whose bodies only do what the jit can (see
+ * jit_compile) also become C functions on longs. once the form has run,
+ * aot_install checks the lambda it made is the one that was compiled
+ * and that the globals are still the builtins they were, and files the
+ * function as the lambda's native code. from then on jit_call runs it in
+ * place of the body, bailing back to the evaluators the same way. */
+
+/* a list of type built from n lvals */
+lval* aot_list(int type, int n, ...) {
+    lval* v = type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+    va_list va;
+    va_start(va, n);
+    for (int i=0; i < n; i++) {
+        lval_add(v, va_arg(va, lval*));
+    }
+    va_end(va);
+    return v;
+}
+
+/* op on the n longs in args, for compiled code. 0 unless that comes to a
+ * long, see jit_builtin. */
+int aot_builtin(lbuiltin op, long* args, int n, long* r) {
+    lval* a = lval_sexpr();
+    for (int i=0; i < n; i++) {
+        lval_add(a, lval_num(args[i]));
+    }
+    lval* x = op(global_env, a);
+    if (LTYPE(x) != LVAL_NUM) {
+        return 0;
+    }
+    *r = LNUM(x);
+    return 1;
+}
+
+/* makes n the native code of the lambda form just defined, as long as
+ * everything it was compiled against still holds */
+void aot_install(aot_native* n, lval* form) {
+    lval* names = form->cell[1];
+    lval* f = lval_fold_global(names->cell[0]->sym);
+    if (f == NULL || LTYPE(f) != LVAL_FUN || LVAL_IS_BUILTIN(f) ||
+            !(f->flags & LFLAG_SIMPLE) || f->hot == JIT_NATIVE ||
+            lval_unfolded(f->body) != form->cell[2] ||
+            f->formals->count != names->count-1) {
+        return;
+    }
+    for (int i=0; i < f->formals->count; i++) {
+        if (f->formals->cell[i]->sym != names->cell[i+1]->sym) {
+            return;
+        }
+    }
+
+    for (int i=0; n->syms[i]; i++) {
+        lval* g = lval_fold_global(sym_intern(n->syms[i]));
+        if (n->fnames[i] == NULL) {
+            if (g != f) {
+                return;
+            }
+        } else if (g == NULL || LTYPE(g) != LVAL_FUN || !LVAL_IS_BUILTIN(g) ||
+                LVAL_IS_MEMO(g) || !STR_EQ(g->fname, n->fnames[i])) {
+            return;
+        } else {
+            n->ops[i] = g->builtin;
+        }
+    }
+    for (int i=0; n->syms[i]; i++) {
+        LSYM(sym_intern(n->syms[i]))->folded = 1;
+    }
+
+    jit_add(f, n->run, 0);
+    f->hot = JIT_NATIVE;
+}
+
+/* main for a program lispy --compile wrote. forms are the stdlib's and
+ * the script's, natives end with a NULL run. takes the same switches as
+ * lispy does. */
+int aot_main(int argc, char** argv, lval* forms, aot_native* natives) {
+    gc_push(forms);
+    for (int i=1; i < argc; i++) {
+        lispy_option(argv[i]);
+    }
+
+    parser_new();
+
+    lenv* e = lenv_new();
+    gc_push_env(e);
+    lenv_add_builtins(e);
+
+    lval_resolve(forms, NULL);
+    for (int i=0; i < forms->count; i++) {
+        lval_run_form(e, forms->cell[i]);
+        for (aot_native* n = natives; n->run; n++) {
+            if (n->form == i) {
+                aot_install(n, forms->cell[i]);
+            }
+        }
+    }
+
+    gc_pop_env(1);
+    gc_pop(1);
+    gc_collect();
+
+    parser_cleanup();
+    return 0;
+}
+
+/* s as a C string literal */
+void aot_cstr(strbuf* b, char* s) {
+    strbuf_add(b, "\"", 1);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            strbuf_printf(b, "\\%c", *s);
+        } else if (*s == '\n') {
+            strbuf_add(b, "\\n", 2);
+        } else if (*s < ' ' || *s > '~') {
+            strbuf_printf(b, "\\%03o", (unsigned char)*s);
+        } else {
+            strbuf_add(b, s, 1);
+        }
+    }
+    strbuf_add(b, "\"", 1);
+}
+
+/* C that builds v again */
+void aot_data(strbuf* b, lval* v) {
+    switch (LTYPE(v)) {
+        case LVAL_NUM:
+            if (LNUM(v) == LONG_MIN) {
+                strbuf_printf(b, "lval_num(LONG_MIN)");
+            } else {
+                strbuf_printf(b, "lval_num(%ldL)", LNUM(v));
+            }
+            break;
+        case LVAL_DUB:
+            strbuf_printf(b, "lval_dub(%a)", LDUB(v));
+            break;
+        case LVAL_ERR:
+            strbuf_printf(b, "lval_err(\"%%s\", ");
+            aot_cstr(b, v->err);
+            strbuf_add(b, ")", 1);
+            break;
+        case LVAL_SYM:
+            strbuf_printf(b, "lval_sym(");
+            aot_cstr(b, v->sym);
+            strbuf_add(b, ")", 1);
+            break;
+        case LVAL_STR:
+            strbuf_printf(b, "lval_str(");
+            aot_cstr(b, v->str);
+            strbuf_add(b, ")", 1);
+            break;
+        default:
+            strbuf_printf(b, "aot_list(%s, %i",
+                    LTYPE(v) == LVAL_SEXPR ? "LVAL_SEXPR" : "LVAL_QEXPR",
+                    v->count);
+            for (int i=0; i < v->count; i++) {
+                strbuf_add(b, ", ", 2);
+                aot_data(b, v->cell[i]);
+            }
+            strbuf_add(b, ")", 1);
+            break;
+    }
+}
+
+int aot_temp(aot_fn* c) {
+    return c->temps++;
+}
+
+/* where sym is in aot_native's syms, adding it if it's new. -1 if there
+ * are too many. */
+int aot_global(aot_fn* c, char* sym, char* fname) {
+    for (int i=0; i < c->nsyms; i++) {
+        if (c->syms[i] == sym) {
+            return i;
+        }
+    }
+    if (c->nsyms == AOT_MAX_GLOBALS) {
+        return -1;
+    }
+    c->syms[c->nsyms] = sym;
+    c->fnames[c->nsyms] = fname;
+    return c->nsyms++;
+}
+
+void aot_return(aot_fn* c, int t) {
+    strbuf_printf(&c->code, "    *r = t%i;\n    return 1;\n", t);
+}
+
+/* C putting the value of v in a new temp, or -1 if it can't. these
+ * follow jit_expr and friends, on longs rather than tagged fixnums, with
+ * a return of 0 for a bail. */
+int aot_expr(aot_fn* c, lval* v, int tail) {
+    int t;
+    switch (LTYPE(v)) {
+        case LVAL_NUM:
+            t = aot_temp(c);
+            if (LNUM(v) == LONG_MIN) {
+                strbuf_printf(&c->code, "    t%i = LONG_MIN;\n", t);
+            } else {
+                strbuf_printf(&c->code, "    t%i = %ldL;\n", t, LNUM(v));
+            }
+            break;
+        case LVAL_SYM: {
+            int formal = lval_formal_slot(c->formals, v->sym);
+            if (formal < 0) {
+                return -1;
+            }
+            t = aot_temp(c);
+            strbuf_printf(&c->code, "    t%i = a%i;\n", t, formal);
+            break;
+        }
+        case LVAL_SEXPR:
+            return aot_code(c, v, tail);
+        default:
+            return -1;
+    }
+    if (tail) {
+        aot_return(c, t);
+    }
+    return t;
+}
+
+int aot_code(aot_fn* c, lval* v, int tail) {
+    if (v->count == 1 && LTYPE(v->cell[0]) != LVAL_QEXPR) {
+        return aot_expr(c, v->cell[0], tail);
+    }
+    if (v->count < 2 || LTYPE(v->cell[0]) != LVAL_SYM ||
+            lval_formal_slot(c->formals, v->cell[0]->sym) >= 0) {
+        return -1;
+    }
+    char* sym = v->cell[0]->sym;
+    lval** args = v->cell + 1;
+    int n = v->count - 1;
+
+    if (sym == c->name) {
+        if (n != c->formals->count || aot_global(c, sym, NULL) < 0) {
+            return -1;
+        }
+        return aot_self(c, args, tail);
+    }
+
+    lval* g = lval_fold_global(sym);
+    if (g == NULL || LTYPE(g) != LVAL_FUN || !LVAL_IS_BUILTIN(g) ||
+            LVAL_IS_MEMO(g)) {
+        return -1;
+    }
+    int k = aot_global(c, sym, g->fname);
+    if (k < 0) {
+        return -1;
+    }
+    if (g->builtin == builtin_if) {
+        if (n != 3 || LTYPE(args[1]) != LVAL_QEXPR ||
+                LTYPE(args[2]) != LVAL_QEXPR) {
+            return -1;
+        }
+        return aot_if(c, args, tail);
+    }
+
+    int t;
+    if (g->builtin == builtin_add || g->builtin == builtin_sub ||
+            g->builtin == builtin_mul) {
+        t = aot_arith(c, g->builtin, args, n);
+    } else if (g->builtin == builtin_lt || g->builtin == builtin_gt ||
+            g->builtin == builtin_lte || g->builtin == builtin_gte ||
+            g->builtin == builtin_eq || g->builtin == builtin_neq) {
+        t = n == 2 ? aot_compare(c, g->fname, args) : -1;
+    } else if (lval_fold_pure(g->builtin) && g->builtin != builtin_concat) {
+        t = aot_callback(c, k, args, n);
+    } else {
+        t = -1;
+    }
+    if (t >= 0 && tail) {
+        aot_return(c, t);
+    }
+    return t;
+}
+
+int aot_arith(aot_fn* c, lbuiltin op, lval** args, int n) {
+    int x;
+    if (n == 0 || (x = aot_expr(c, args[0], 0)) < 0) {
+        return -1;
+    }
+    if (n == 1 && op == builtin_sub) {
+        int t = aot_temp(c);
+        strbuf_printf(&c->code,
+                "    if (t%i == LONG_MIN) {\n        return 0;\n    }\n"
+                "    t%i = -t%i;\n", x, t, x);
+        return t;
+    }
+    char* name = op == builtin_add ? "add" : op == builtin_sub ? "sub" : "mul";
+    for (int i=1; i < n; i++) {
+        int y = aot_expr(c, args[i], 0);
+        if (y < 0) {
+            return -1;
+        }
+        int t = aot_temp(c);
+        strbuf_printf(&c->code,
+                "    if (__builtin_%s_overflow(t%i, t%i, &t%i)) {\n"
+                "        return 0;\n    }\n", name, x, y, t);
+        x = t;
+    }
+    return x;
+}
+
+/* the comparison builtins are named for the C operators */
+int aot_compare(aot_fn* c, char* op, lval** args) {
+    int x = aot_expr(c, args[0], 0);
+    int y = x < 0 ? -1 : aot_expr(c, args[1], 0);
+    if (y < 0) {
+        return -1;
+    }
+    int t = aot_temp(c);
+    strbuf_printf(&c->code, "    t%i = t%i %s t%i;\n", t, x, op, y);
+    return t;
+}
+
+int aot_if(aot_fn* c, lval** args, int tail) {
+    int x = aot_expr(c, args[0], 0);
+    if (x < 0) {
+        return -1;
+    }
+    int t = tail ? 0 : aot_temp(c);
+    strbuf_printf(&c->code, "    if (t%i) {\n", x);
+    int y = aot_code(c, args[1], tail);
+    if (y < 0) {
+        return -1;
+    }
+    if (!tail) {
+        strbuf_printf(&c->code, "    t%i = t%i;\n", t, y);
+    }
+    strbuf_printf(&c->code, "    } else {\n");
+    if ((y = aot_code(c, args[2], tail)) < 0) {
+        return -1;
+    }
+    if (!tail) {
+        strbuf_printf(&c->code, "    t%i = t%i;\n", t, y);
+    }
+    strbuf_printf(&c->code, "    }\n");
+    return t;
+}
+
+/* a call to itself. in tail position it takes the new args and starts
+ * again, otherwise it costs one of budget, see jit_call */
+int aot_self(aot_fn* c, lval** args, int tail) {
+    int n = c->formals->count;
+    int x[n];
+    for (int i=0; i < n; i++) {
+        if ((x[i] = aot_expr(c, args[i], 0)) < 0) {
+            return -1;
+        }
+    }
+    if (tail) {
+        for (int i=0; i < n; i++) {
+            strbuf_printf(&c->code, "    a%i = t%i;\n", i, x[i]);
+        }
+        strbuf_printf(&c->code, "    goto top;\n");
+        c->tail_calls++;
+        return 0;
+    }
+
+    int t = aot_temp(c);
+    strbuf_printf(&c->code,
+            "    if (budget <= 1) {\n"
+            "        jit.deep = 1;\n"
+            "        return 0;\n"
+            "    }\n"
+            "    if (!aot_run_%i(", c->form);
+    for (int i=0; i < n; i++) {
+        strbuf_printf(&c->code, "t%i, ", x[i]);
+    }
+    strbuf_printf(&c->code, "budget-1, &t%i)) {\n        return 0;\n    }\n", t);
+    return t;
+}
+
+/* the other pure builtins go back through the real thing, whatever
+ * aot_install finds it bound to */
+int aot_callback(aot_fn* c, int k, lval** args, int n) {
+    int x[n];
+    for (int i=0; i < n; i++) {
+        if ((x[i] = aot_expr(c, args[i], 0)) < 0) {
+            return -1;
+        }
+    }
+    int t = aot_temp(c);
+    strbuf_printf(&c->code, "    {\n        long args[] = { ");
+    for (int i=0; i < n; i++) {
+        strbuf_printf(&c->code, "%st%i", i ? ", " : "", x[i]);
+    }
+    strbuf_printf(&c->code, " };\n"
+            "        if (!aot_builtin(aot_ops_%i[%i], args, %i, &t%i)) {\n"
+            "            return 0;\n        }\n    }\n", c->form, k, n, t);
+    return t;
+}
+
+/* whether form is (fun {name formals...} {body}) with distinct formals
+ * and no '&', which stdlib fun makes a simple lambda of */
+int aot_fun_form(lval* form) {
+    if (form->count != 3 || LTYPE(form->cell[0]) != LVAL_SYM ||
+            form->cell[0]->sym != sym_fun ||
+            LTYPE(form->cell[1]) != LVAL_QEXPR ||
+            LTYPE(form->cell[2]) != LVAL_QEXPR) {
+        return 0;
+    }
+    lval* names = form->cell[1];
+    if (names->count < 2 || names->count > LENV_HASH_THRESHOLD + 1) {
+        return 0;
+    }
+    for (int i=0; i < names->count; i++) {
+        if (LTYPE(names->cell[i]) != LVAL_SYM || names->cell[i]->sym == sym_amp) {
+            return 0;
+        }
+        for (int j=1; j < i; j++) {
+            if (names->cell[j]->sym == names->cell[i]->sym) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* writes out the fun definition that's form i as C, if its body is all
+ * things aot_expr can do. the natives table entry goes on table. */
+void aot_fun(strbuf* b, strbuf* table, lval* form, int i) {
+    if (!aot_fun_form(form)) {
+        return;
+    }
+    aot_fn c = { { NULL, 0, 0 }, i, form->cell[1]->cell[0]->sym,
+        lval_slice(form->cell[1], 1), 0, 0, { NULL }, { NULL }, 0 };
+    int n = c.formals->count;
+    if (aot_code(&c, form->cell[2], 1) < 0) {
+        free(c.code.s);
+        return;
+    }
+
+    strbuf_printf(b, "/* (fun {%s ...} ...), form %i */\n", c.name, i);
+    strbuf_printf(b, "lbuiltin aot_ops_%i[%i];\n\n", i, MAX(c.nsyms, 1));
+    strbuf_printf(b, "int aot_run_%i(", i);
+    for (int j=0; j < n; j++) {
+        strbuf_printf(b, "long a%i, ", j);
+    }
+    strbuf_printf(b, "long budget, long* r) {\n");
+    if (c.temps > 0) {
+        strbuf_printf(b, "    long t0");
+        for (int j=1; j < c.temps; j++) {
+            strbuf_printf(b, ", t%i", j);
+        }
+        strbuf_printf(b, ";\n");
+    }
+    if (c.tail_calls) {
+        strbuf_printf(b, "top:\n");
+    }
+    strbuf_add(b, c.code.s, c.code.len);
+    strbuf_printf(b, "}\n\n");
+
+    strbuf_printf(b, "lval* aot_fn_%i(lval** args, long budget) {\n", i);
+    strbuf_printf(b, "    long r;\n    if (");
+    for (int j=0; j < n; j++) {
+        strbuf_printf(b, "%sLTYPE(args[%i]) != LVAL_NUM", j ? " ||\n            " : "", j);
+    }
+    strbuf_printf(b, ") {\n        return NULL;\n    }\n");
+    strbuf_printf(b, "    return aot_run_%i(", i);
+    for (int j=0; j < n; j++) {
+        strbuf_printf(b, "LNUM(args[%i]), ", j);
+    }
+    strbuf_printf(b, "budget, &r) ? lval_num(r) : NULL;\n}\n\n");
+
+    strbuf_printf(table, "    { %i, aot_fn_%i, aot_ops_%i,\n        (char*[]){ ", i, i, i);
+    for (int j=0; j < c.nsyms; j++) {
+        aot_cstr(table, c.syms[j]);
+        strbuf_add(table, ", ", 2);
+    }
+    strbuf_printf(table, "NULL },\n        (char*[]){ ");
+    for (int j=0; j < c.nsyms; j++) {
+        if (c.fnames[j]) {
+            aot_cstr(table, c.fnames[j]);
+        } else {
+            strbuf_printf(table, "NULL");
+        }
+        strbuf_add(table, ", ", 2);
+    }
+    strbuf_printf(table, "NULL } },\n");
+    free(c.code.s);
+}
+
+/* lispy --compile in -o out, see aot_main. returns the exit status. */
+int aot_compile(char* in, char* out) {
+    lval* forms = lval_read_file(STD_LIB);
+    lval* script = lval_read_file(in);
+    if (LTYPE(forms) == LVAL_ERR || LTYPE(script) == LVAL_ERR) {
+        lval_println(LTYPE(forms) == LVAL_ERR ? forms : script);
+        return 1;
+    }
+    for (int i=0; i < script->count; i++) {
+        lval_add(forms, script->cell[i]);
+    }
+
+    strbuf b = { NULL, 0, 0 };
+    strbuf table = { NULL, 0, 0 };
+    strbuf_printf(&b,
+            "/* %s and the stdlib, compiled by lispy --compile. build it\n"
+            " * alongside lispy.c, mpc.c and hash_table.c, see aot_main. */\n"
+            "#define LISPY_NO_MAIN\n"
+            "#include \"lispy.c\"\n\n", in);
+    for (int i=0; i < forms->count; i++) {
+        aot_fun(&b, &table, forms->cell[i], i);
+    }
+
+    strbuf_printf(&b, "aot_native aot_natives[] = {\n");
+    if (table.s) {
+        strbuf_add(&b, table.s, table.len);
+    }
+    strbuf_printf(&b, "    { -1, NULL, NULL, NULL, NULL },\n};\n\n");
+
+    strbuf_printf(&b, "lval* aot_forms(void) {\n    lval* x = lval_sexpr();\n");
+    for (int i=0; i < forms->count; i++) {
+        strbuf_printf(&b, "    lval_add(x, ");
+        aot_data(&b, forms->cell[i]);
+        strbuf_printf(&b, ");\n");
+    }
+    strbuf_printf(&b, "    return x;\n}\n\n");
+    strbuf_printf(&b,
+            "int main(int argc, char** argv) {\n"
+            "    return aot_main(argc, argv, aot_forms(), aot_natives);\n"
+            "}\n");
+
+    FILE* f = fopen(out, "w");
+    int ok = f && fwrite(b.s, 1, b.len, f) == b.len;
+    if (f) {
+        ok = fclose(f) == 0 && ok;
+    }
+    if (!ok) {
+        fprintf(stderr, "Could not write %s\n", out);
+    }
+    free(b.s);
+    free(table.s);
+    return !ok;
+}
+
+lval* builtin_gc(lenv* e, lval* a) {
+    LCHECK_COUNT("gc", a, 0);
+
+    gc_collect();
+
+    lval* v = lval_qexpr();
+    v = lval_add(v, lval_sym("collected"));
+    v = lval_add(v, lval_num(gc.collected));
+    v = lval_add(v, lval_sym("live"));
+    v = lval_add(v, lval_num(gc.count));
+    v = lval_add(v, lval_sym("pause-ms"));
+    v = lval_add(v, lval_dub(gc.pause_ms));
+    v = lval_add(v, lval_sym("lval-slabs"));
+    v = lval_add(v, lval_num(lval_pool.slabs));
+    v = lval_add(v, lval_sym("lval-occupancy"));
+    v = lval_add(v, lval_dub(pool_occupancy(&lval_pool)));
+    v = lval_add(v, lval_sym("lenv-slabs"));
+    v = lval_add(v, lval_num(lenv_pool.slabs));
+    v = lval_add(v, lval_sym("lenv-occupancy"));
+    v = lval_add(v, lval_dub(pool_occupancy(&lenv_pool)));
+    return v;
+}
+
+lval* builtin_gc_growth(lenv* e, lval* a) {
+    LCHECK_COUNT("gc-growth", a, 1);
+    LCHECK_TYPE("gc-growth", a->cell[0], LVAL_DUB);
+    LCHECK(LDUB(a->cell[0]) > 1.0,
+        "Function 'gc-growth' needs a growth factor above 1.0");
+
+    gc.growth = LDUB(a->cell[0]);
+    return lval_ok();
+}
+
+lval* builtin_max_depth(lenv* e, lval* a) {
+    LCHECK_COUNT("max-depth", a, 1);
+    LCHECK_TYPE("max-depth", a->cell[0], LVAL_NUM);
+    LCHECK(LNUM(a->cell[0]) > 0 && LNUM(a->cell[0]) <= INT_MAX,
+        "Function 'max-depth' needs a depth between 1 and %i", INT_MAX);
+
+    ev.max_depth = LNUM(a->cell[0]);
+    return lval_ok();
+}
+
+/* room for n more chars and the '\0' after them */
+void strbuf_reserve(strbuf* b, size_t n) {
+    if (b->len + n + 1 > b->cap) {
+        b->cap = MAX(64, MAX(b->cap * 2, b->len + n + 1));
+        b->s = realloc(b->s, b->cap);
+    }
+}
+
+void strbuf_add(strbuf* b, char* s, size_t n) {
+    strbuf_reserve(b, n);
+    memcpy(b->s + b->len, s, n);
+    b->len += n;
+    b->s[b->len] = '\0';
+}
+
+void strbuf_printf(strbuf* b, char* fmt, ...) {
+    char s[64];
+    va_list va;
+    va_start(va, fmt);
+    int n = vsnprintf(s, sizeof(s), fmt, va);
+    va_end(va);
+    if (n < sizeof(s)) {
+        strbuf_add(b, s, n);
+        return;
+    }
+
+    /* too long for s, so again, straight into b */
+    strbuf_reserve(b, n);
+    va_start(va, fmt);
+    vsnprintf(b->s + b->len, n + 1, fmt, va);
+    va_end(va);
+    b->len += n;
+}
+
+/* writes v to b so that two values get the same key exactly when they're
+ * the same. 0 if v can't be a key: lambdas compare by their code, but
+ * what they do also depends on what they've bound. */
+int memo_key_add(strbuf* b, lval* v) {
+    switch (LTYPE(v)) {
+        case LVAL_NUM:
+            strbuf_printf(b, "i%li ", LNUM(v));
+            return 1;
+        case LVAL_DUB:
+            strbuf_printf(b, "d%a ", LDUB(v));
+            return 1;
+        case LVAL_SYM:
+            strbuf_printf(b, "y%s ", v->sym);
+            return 1;
+        case LVAL_STR:
+            strbuf_printf(b, "s%zu:", strlen(v->str));
+            strbuf_add(b, v->str, strlen(v->str));
+            return 1;
+        case LVAL_FUN:
+            if (LVAL_IS_BUILTIN(v) && !v->memo) {
+                strbuf_printf(b, "b%s ", v->fname);
+                return 1;
+            }
+            return 0;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            strbuf_add(b, LTYPE(v) == LVAL_SEXPR ? "(" : "{", 1);
+            for (int i=0; i < v->count; i++) {
+                if (!memo_key_add(b, v->cell[i])) {
+                    return 0;
+                }
+            }
+            strbuf_add(b, ")", 1);
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* the cache key for args a, to be freed, or NULL if they can't have one */
+char* memo_key(lval* a) {
+    strbuf b = { NULL, 0, 0 };
+    if (!memo_key_add(&b, a)) {
+        free(b.s);
+        return NULL;
+    }
+    return b.s;
+}
+
+/* calls the function the memo f wraps on a, unless it's seen a before.
+ * errors aren't kept: running out of depth one time says nothing about
+ * the next. */
+lval* memo_call(lenv* e, lval* f, lval* a) {
+    memo* m = f->memo;
+    char* key = memo_key(a);
+    lval* r = memo_get(m, key);
+    if (r) {
+        free(key);
+        return r;
+    }
+
+    gc_push(f);
+    r = lval_call(e, m->f, a);
+    gc_pop(1);
+    if (key && LTYPE(r) != LVAL_ERR) {
+        hash_table_add(m->cache, key, r);
+    }
+    free(key);
+    return r;
+}
+
+/* m's result for key (which can be NULL), counting the hit or miss */
+lval* memo_get(memo* m, char* key) {
+    lval* r = key ? hash_table_get(m->cache, key) : NULL;
+    if (r) {
+        m->hits++;
+    } else {
+        m->misses++;
+    }
+    return r;
+}
+
+/* memo_call for the tree walker, which runs what f wraps in the frame fr
+ * rather than through C, so memoized recursion goes as deep as max-depth.
+ * returns the result if f has seen a before. otherwise NULL, with f and
+ * its key for a on fr->memo for memo_keep once fr has the result. */
+lval* memo_enter(eval_frame* fr, lval* f, lval* a) {
+    char* key = memo_key(a);
+    lval* r = memo_get(f->memo, key);
+    if (r == NULL && key) {
+        if (fr->memo == NULL) {
+            fr->memo = lval_sexpr();
+        }
+        lval_add(fr->memo, f);
+        lval_add(fr->memo, lval_str(key));
+    }
+    free(key);
+    return r;
+}
+
+/* keeps r for each memo and key pair a frame collected. there's more than
+ * one when a memoized function calls one in tail position. */
+void memo_keep(lval* keys, lval* r) {
+    for (int i=0; i < keys->count; i += 2) {
+        hash_table_add(keys->cell[i]->memo->cache, keys->cell[i+1]->str, r);
+    }
+}
+
+lval* builtin_memo(lenv* e, lval* a) {
+    LCHECK(a->count == 1 || a->count == 2,
+        "Function 'memo' passed incorrect number of arguments! Got %i, Expected 1 or 2.",
+        a->count);
+    LCHECK_TYPE("memo", a->cell[0], LVAL_FUN);
+
+    long limit = MEMO_LIMIT;
+    if (a->count == 2) {
+        LCHECK_TYPE("memo", a->cell[1], LVAL_NUM);
+        LCHECK(LNUM(a->cell[1]) > 0,
+            "Function 'memo' needs room for at least 1 result. Got %li",
+            LNUM(a->cell[1]));
+        limit = LNUM(a->cell[1]);
+    }
+    return lval_memo(a->cell[0], limit);
+}
+
+/* {hits misses size limit} for a function from memo */
+lval* builtin_memo_stats(lenv* e, lval* a) {
+    LCHECK_COUNT("memo-stats", a, 1);
+    LCHECK_TYPE("memo-stats", a->cell[0], LVAL_FUN);
+    LCHECK(LVAL_IS_MEMO(a->cell[0]),
+        "Function 'memo-stats' passed a function memo didn't make");
+    memo* m = a->cell[0]->memo;
+
+    lval* v = lval_qexpr();
+    lval_add(v, lval_num(m->hits));
+    lval_add(v, lval_num(m->misses));
+    lval_add(v, lval_num(m->cache->capacity));
+    lval_add(v, lval_num(m->cache->limit));
+    return v;
+}
+
+/* the grammar, which load, parse and read all go through */
+void parser_new(void) {
+    Number   = mpc_new("number");
+    Double   = mpc_new("double");
+    Symbol   = mpc_new("symbol");
+    String   = mpc_new("string");
+    Comment  = mpc_new("comment");
+    Sexpr    = mpc_new("sexpr");
+    Qexpr    = mpc_new("qexpr");
+    Expr     = mpc_new("expr");
+    Lispy    = mpc_new("lispy");
+
+    mpca_lang(MPCA_LANG_DEFAULT,
+            "                                                                  \
+            double   : /-?[0-9]+\\.[0-9]+/ ;                                   \
+            number   : /-?[0-9]+/ ;                                            \
+            symbol   : /[a-zA-Z0-9_+i\\-*\\/%^\\\\=<>!\?&|]+/;                 \
+            string   : /\"(\\\\.|[^\"])*\"/ ;                                  \
+            comment  : /;[^\\r\\n]*/;                                          \
+            sexpr    : '(' <expr>* ')';                                        \
+            qexpr    : '{' <expr>* '}';                                        \
+            expr     : <double> | <number> | <symbol> | <string> | <comment> | <sexpr> | <qexpr> ; \
+            lispy    : /^/ <expr>* /$/ ;                                       \
+            ",
+            Number, Double, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+}
+
+void parser_cleanup(void) {
     mpc_cleanup(9, Number, Double, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+}
+
+/* --vm runs everything, stdlib included, on the bytecode vm.
+ * --closures compiles lambda bodies, see cnode_compile.
+ * --fold folds constants, see lval_fold, and --dump-folds shows how.
+ * --no-jit keeps hot lambdas off native code, see jit_call.
+ * returns 0 if arg isn't one of them. */
+int lispy_option(char* arg) {
+    if (STR_EQ(arg, "--vm")) {
+        vm.enabled = 1;
+        cnode_enabled = 0;
+    } else if (STR_EQ(arg, "--closures")) {
+        cnode_enabled = 1;
+        vm.enabled = 0;
+    } else if (STR_EQ(arg, "--fold")) {
+        folds.enabled = 1;
+    } else if (STR_EQ(arg, "--dump-folds")) {
+        folds.enabled = 1;
+        folds.dump = 1;
+    } else if (STR_EQ(arg, "--no-jit")) {
+        jit.enabled = 0;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/* lispy_bench.c and programs from --compile include this file and bring
+ * their own main */
+#ifndef LISPY_NO_MAIN
+int main(int argc, char** argv) {
+    /* --compile foo.lispy -o foo.c writes foo.lispy out as C rather than
+     * running it, see aot_compile */
+    char* compile = NULL;
+    char* out = NULL;
+    int files = 0;
+    for (int i=1; i < argc; i++) {
+        if (STR_EQ(argv[i], "--compile") && i+1 < argc) {
+            compile = argv[++i];
+        } else if (STR_EQ(argv[i], "-o") && i+1 < argc) {
+            out = argv[++i];
+        } else if (!lispy_option(argv[i])) {
+            files++;
+        }
+    }
+    if (compile && !out) {
+        fprintf(stderr, "Usage: lispy --compile file.lispy -o file.c\n");
+        return 1;
+    }
+
+    if (!compile) {
+        puts("Lispy Version 0.0.1");
+        puts("Press Ctrl+d to Exit\n");
+    }
+
+    parser_new();
+
+    lenv* e = lenv_new();
+    gc_push_env(e);
+    lenv_add_builtins(e);
+
+    /* load standard library */
+    builtin_load(e, lval_add(lval_sexpr(), lval_str(STD_LIB)));
+
+    if (compile) {
+        int status = aot_compile(compile, out);
+        gc_pop_env(1);
+        gc_collect();
+        parser_cleanup();
+        return status;
+    }
+
+    if (files == 0) {
+        while(1) {
+            char* input = readline("lispy> ");
+            add_history(input);
+            if (!input) { break; }
+
+            lval* in = lval_add(lval_sexpr(), lval_str(input));
+            lval* x = builtin_parse(e, in);
+            if (LTYPE(x) == LVAL_ERR) {
+                lval_println(x);
+            } else {
+                /* each form on the line is evaluated and printed */
+                gc_push(x);
+                lval_resolve(x, NULL);
+                for (int i=0; i < x->count; i++) {
+                    lval* y = lval_expand_form(x->cell[i]);
+                    gc_push(y);
+                    lval_println(lval_eval(e, y));
+                    gc_pop(1);
+                }
+                gc_pop(1);
+            }
+
+            free(input);
+        }
+    }
+
+    if (files > 0) {
+        for (int i=1; i < argc; i++) {
+            if (lispy_option(argv[i])) {
+                continue;
+            }
+            lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
+            lval* x = builtin_load(e, args);
+
+            if (LTYPE(x) == LVAL_ERR) {
+                lval_println(x);
+            }
+        }
+    }
+
+    /* nothing is rooted any more, so this frees everything */
+    gc_pop_env(1);
+    gc_collect();
+
+    parser_cleanup();
     return 0;
 }
+#endif
@@ -0,0 +1,344 @@
+/* micro benchmarks for the interpreter internals.
+ * pulls in lispy.c whole so it can poke at lenv/lval directly. */
+#define LISPY_NO_MAIN
+#include "lispy.c"
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define LOOKUPS 1000000
+
+double elapsed_ns(clock_t start, long n) {
+    return ((double)(clock() - start) / CLOCKS_PER_SEC) * 1e9 / n;
+}
+
+/* global env with the builtins plus `size` extra definitions */
+lenv* bench_global_env(int size) {
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+
+    char name[32];
+    for (int i=0; i < size; i++) {
+        snprintf(name, sizeof(name), "def-%i", i);
+        lenv_put(e, lval_sym(name), lval_num(i));
+    }
+    return e;
+}
+
+/* look up a spread of globals from a small call frame, like a function body
+ * referring to stdlib functions would. */
+void bench_lenv_get(int size) {
+    lenv* e = bench_global_env(size);
+    lenv* local = lenv_new();
+    local->parent = e;
+
+    lval* x = lval_sym("x");
+    lenv_put(local, x, lval_num(1));
+
+    lval* syms[8];
+    char name[32];
+    for (int i=0; i < 8; i++) {
+        snprintf(name, sizeof(name), "def-%i", (size-1) * i / 7);
+        syms[i] = lval_sym(name);
+    }
+
+    long misses = 0;
+    clock_t start = clock();
+    for (long i=0; i < LOOKUPS; i++) {
+        misses += LTYPE(lenv_get(local, syms[i & 7])) == LVAL_ERR;
+    }
+    double global_ns = elapsed_ns(start, LOOKUPS);
+
+    start = clock();
+    for (long i=0; i < LOOKUPS; i++) {
+        misses += LTYPE(lenv_get(local, x)) == LVAL_ERR;
+    }
+    double local_ns = elapsed_ns(start, LOOKUPS);
+
+    printf("lenv_get  %6i globals: %8.1f ns/global  %8.1f ns/local  %li misses\n",
+            e->count, global_ns, local_ns, misses);
+
+    /* nothing here is rooted, so this throws the whole env away */
+    gc_collect();
+}
+
+/* build a list one cell at a time and drain it again from the back */
+void bench_lval_add(int size) {
+    lval* v = lval_qexpr();
+
+    clock_t start = clock();
+    for (int i=0; i < size; i++) {
+        lval_add(v, lval_num(i));
+    }
+    double add_ns = elapsed_ns(start, size);
+
+    start = clock();
+    while (v->count > 0) {
+        lval_pop(v, v->count-1);
+    }
+    double pop_ns = elapsed_ns(start, size);
+
+    printf("lval_add  %8i cells:   %8.1f ns/add     %8.1f ns/pop\n",
+            size, add_ns, pop_ns);
+
+    gc_collect();
+}
+
+/* (+ 0 1 2 ...) with `size` arguments, through the evaluator */
+void bench_add_args(lenv* e, int size) {
+    lval* expr = lval_sexpr();
+    lval_add(expr, lval_sym("+"));
+    for (int i=0; i < size; i++) {
+        lval_add(expr, lval_num(i));
+    }
+    gc_push(expr);
+
+    clock_t start = clock();
+    lval* sum = lval_eval_sexpr(e, expr);
+    double ns = elapsed_ns(start, 1);
+
+    printf("(+ ...)   %8i args:    %8.1f us         sum %li\n",
+            size, ns / 1000, LNUM(sum));
+
+    gc_pop(1);
+}
+
+/* walk the list v to the end with tail, like the recursive stdlib
+ * functions. ns per tail. with collect the gc gets a safe point after
+ * each one, as it would in a loop, and has to mark what's left of the
+ * list whenever it collects. */
+double bench_tail_walk(lenv* e, lval* v, int collect) {
+    lval* tail = lenv_get(e, lval_sym("tail"));
+    long steps = 0;
+    gc_push(v);
+    clock_t start = clock();
+    while (v->count > 0) {
+        lval* a = lval_add(lval_sexpr(), v);
+        v = tail->builtin(e, a);
+        gc_pop(1);
+        gc_push(v);
+        if (collect) {
+            gc_maybe_collect();
+        }
+        steps++;
+    }
+    double ns = elapsed_ns(start, steps);
+    gc_pop(1);
+    return ns;
+}
+
+void bench_tail(lenv* e, int size) {
+    lval* v = lval_qexpr();
+    for (int i=0; i < size; i++) {
+        lval_add(v, lval_num(i));
+    }
+    gc_push(v);
+
+    double bare = bench_tail_walk(e, v, 0);
+    gc_collect();
+    double collected = bench_tail_walk(e, v, 1);
+
+    printf("tail      %8i cells:   %8.1f ns/tail    %8.1f ns/tail with gc\n",
+            size, bare, collected);
+
+    gc_pop(1);
+}
+
+/* an arg for op that keeps a long fold of them from overflowing or
+ * dividing by zero */
+long bench_arith_arg(char* op, int i) {
+    if (i == 0) {
+        return 1 << 20;
+    }
+    if (STR_EQ(op, "*") || STR_EQ(op, "/") || STR_EQ(op, "^")) {
+        return 1;
+    }
+    return i;
+}
+
+/* each arithmetic builtin called straight on `size` args, all longs and
+ * then all doubles */
+void bench_arith(lenv* e, int size) {
+    char* ops[] = { "+", "-", "*", "/", "%", "^", "min", "max" };
+    int reps = 1000;
+
+    for (int o=0; o < sizeof(ops)/sizeof(ops[0]); o++) {
+        lval* f = lenv_get(e, lval_sym(ops[o]));
+        lval* nums = lval_sexpr();
+        lval* dubs = lval_sexpr();
+        for (int i=0; i < size; i++) {
+            long x = bench_arith_arg(ops[o], i);
+            lval_add(nums, lval_num(x));
+            lval_add(dubs, lval_dub(x + 0.5));
+        }
+        gc_push(nums);
+        gc_push(dubs);
+
+        clock_t start = clock();
+        for (int r=0; r < reps; r++) {
+            f->builtin(e, nums);
+        }
+        double num_ns = elapsed_ns(start, (long)reps * size);
+
+        start = clock();
+        for (int r=0; r < reps; r++) {
+            f->builtin(e, dubs);
+        }
+        double dub_ns = elapsed_ns(start, (long)reps * size);
+
+        printf("(%-3s ...) %6i args:  %8.2f ns/long   %8.2f ns/double\n",
+                ops[o], size, num_ns, dub_ns);
+        gc_pop(2);
+    }
+}
+
+/* the kinds of code tests.lispy runs: stdlib functions built on select
+ * and case, list functions, recursion in and out of tail position, and a
+ * guard clause through stdlib and, which evaluates both sides, and &&,
+ * which skips the second. g is deep-count under a name stdlib functions
+ * take as an argument (comp), which mustn't make looking it up slower. */
+char* workload_defs =
+    "(fun {tail-count n acc} {if (== n 0) {acc} {tail-count (- n 1) (+ acc 1)}})"
+    "(fun {deep-count n} {if (== n 0) {0} {+ 1 (deep-count (- n 1))}})"
+    "(fun {g n} {if (== n 0) {0} {+ 1 (g (- n 1))}})"
+    "(fun {fib-if n} {if (< n 2) {n} {+ (fib-if (- n 1)) (fib-if (- n 2))}})"
+    "(def {digits} {0 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19})"
+    "(fun {expensive l} {== (sum (map (\\ {x} {* x x}) l)) 0})";
+
+struct {
+    char* code;
+    int reps;
+} workloads[] = {
+    { "(fib 16)", 1 },
+    { "(day-name 6)", 2000 },
+    { "(month-day-suffix 3)", 2000 },
+    { "(sum (map (\\ {x} {* x x}) (filter (\\ {x} {== (% x 2) 0}) digits)))", 500 },
+    { "(nth 15 digits)", 2000 },
+    { "(tail-count 100000 0)", 1 },
+    { "(deep-count 20000)", 1 },
+    { "(g 20000)", 1 },
+    { "(fib-if 22)", 1 },
+    { "(and (== digits nil) (expensive digits))", 500 },
+    { "(&& (== digits nil) (expensive digits))", 500 },
+};
+
+/* evaluates each form of the string src in e, reps times over */
+double bench_run(lenv* e, char* src, int reps) {
+    lval* x = builtin_parse(e, lval_add(lval_sexpr(), lval_str(src)));
+    gc_push(x);
+    lval_resolve(x, NULL);
+
+    clock_t start = clock();
+    for (int r=0; r < reps; r++) {
+        for (int i=0; i < x->count; i++) {
+            lval* v = lval_eval(e, x->cell[i]);
+            if (LTYPE(v) == LVAL_ERR) {
+                lval_println(v);
+            }
+        }
+    }
+    double ms = (double)(clock() - start) * 1000 / CLOCKS_PER_SEC;
+
+    gc_pop(1);
+    return ms;
+}
+
+/* the workloads on the tree walker, the vm, the closure tier and the
+ * tree walker with the jit. each runs in a child of its own, so it starts
+ * from the same state as the others: an env loaded after another one
+ * sees every stdlib name def'd twice, and lval_fold won't put in
+ * constants like nil for it. */
+void bench_evaluators(void) {
+    char* names[] = { "tree", "vm", "closures", "jit" };
+    double ms[4][sizeof(workloads)/sizeof(workloads[0])];
+    int nwork = sizeof(workloads)/sizeof(workloads[0]);
+
+    fflush(stdout);
+    for (int m=0; m < 4; m++) {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            perror("pipe");
+            exit(1);
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0) {
+            vm.enabled = m == 1;
+            cnode_enabled = m == 2;
+            jit.enabled = m == 3;
+
+            lenv* e = bench_global_env(0);
+            gc_push_env(e);
+            builtin_load(e, lval_add(lval_sexpr(), lval_str(STD_LIB)));
+            bench_run(e, workload_defs, 1);
+
+            for (int w=0; w < nwork; w++) {
+                /* one untimed run so the vm has something warm to
+                 * compile, then the best of a few */
+                bench_run(e, workloads[w].code, 1);
+                ms[m][w] = 1e9;
+                for (int i=0; i < 5; i++) {
+                    ms[m][w] = MIN(ms[m][w],
+                            bench_run(e, workloads[w].code, workloads[w].reps));
+                }
+            }
+            fflush(stdout);
+            if (write(fds[1], ms[m], sizeof(ms[m])) != sizeof(ms[m])) {
+                _exit(1);
+            }
+            _exit(0);
+        }
+
+        close(fds[1]);
+        if (read(fds[0], ms[m], sizeof(ms[m])) != sizeof(ms[m])) {
+            fprintf(stderr, "%s: no timings\n", names[m]);
+            exit(1);
+        }
+        close(fds[0]);
+        waitpid(pid, NULL, 0);
+    }
+
+    printf("%-72s %9s %9s %9s %9s\n", "workload (ms)",
+            names[0], names[1], names[2], names[3]);
+    for (int w=0; w < nwork; w++) {
+        char label[80];
+        snprintf(label, sizeof(label), "%s x%i", workloads[w].code, workloads[w].reps);
+        printf("%-72s %9.1f %9.1f %9.1f %9.1f\n", label,
+                ms[0][w], ms[1][w], ms[2][w], ms[3][w]);
+    }
+}
+
+int main(int argc, char** argv) {
+    printf("sizeof(lval) %zu\n", sizeof(lval));
+
+    int sizes[] = { 16, 64, 256, 1024, 4096, 16384 };
+    for (int i=0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+        bench_lenv_get(sizes[i]);
+    }
+
+    int cells[] = { 1000, 100000, 1000000 };
+    for (int i=0; i < sizeof(cells)/sizeof(cells[0]); i++) {
+        bench_lval_add(cells[i]);
+    }
+
+    lenv* e = bench_global_env(0);
+    gc_push_env(e);
+    int args[] = { 100, 1000, 10000 };
+    for (int i=0; i < sizeof(args)/sizeof(args[0]); i++) {
+        bench_add_args(e, args[i]);
+    }
+    for (int i=0; i < sizeof(args)/sizeof(args[0]); i++) {
+        bench_tail(e, args[i] * 10);
+    }
+    bench_arith(e, 1000);
+    gc_pop_env(1);
+
+    parser_new();
+    bench_evaluators();
+    parser_cleanup();
+    return 0;
+}